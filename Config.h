@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Consts.h"
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+/**
+ * @brief Emulated device parameters
+ *
+ */
+struct DeviceParams {
+  double latency;   //!< milliseconds
+  double bandwidth; //!< MB/s
+};
+
+/**
+ * @brief Memory hierarchy of the sort, set once before the plan is built.
+ *
+ * Sizes default to Consts.h. Every key can be given on the command line as
+ * `--key value`, with `-` for `_`, or in a config file of `key = value`
+ * lines; `#` starts a comment. Sizes take a K, M, G or T suffix (binary).
+ * The sizing helpers of Utils.h derive runs, fan-in and pages from it.
+ */
+struct Config {
+  static inline std::size_t cache_size = kCacheSize; //!< bytes
+  static inline std::size_t mem_size = kMemSize;     //!< bytes
+  static inline uint64_t ssd_size = kSSDSize;        //!< bytes
+  static inline DeviceParams ssd = {0.1, 200};
+  static inline DeviceParams hdd = {5, 100};
+
+  /**
+   * @brief Parse a size such as 4096, 32M or 1T
+   *
+   */
+  static uint64_t parse_size(std::string const &value) {
+    std::size_t end = 0;
+    uint64_t size = std::stoull(value, &end);
+    std::string const unit = value.substr(end);
+    if (unit.empty()) {
+      return size;
+    }
+    static constexpr char kUnits[] = "KMGT";
+    for (std::size_t i = 0; i < sizeof(kUnits) - 1; ++i) {
+      size *= 1024;
+      if (unit == std::string(1, kUnits[i]) ||
+          unit == std::string(1, kUnits[i]) + "B") {
+        return size;
+      }
+    } // for
+    throw std::invalid_argument("bad size: " + value);
+  }
+
+  /**
+   * @brief Set \p key to \p value
+   *
+   */
+  static void set(std::string const &key, std::string const &value) {
+    if (key == "cache_size") {
+      cache_size = parse_size(value);
+    } else if (key == "mem_size") {
+      mem_size = parse_size(value);
+    } else if (key == "ssd_size") {
+      ssd_size = parse_size(value);
+    } else if (key == "ssd_latency") {
+      ssd.latency = std::stod(value);
+    } else if (key == "ssd_bandwidth") {
+      ssd.bandwidth = std::stod(value);
+    } else if (key == "hdd_latency") {
+      hdd.latency = std::stod(value);
+    } else if (key == "hdd_bandwidth") {
+      hdd.bandwidth = std::stod(value);
+    } else {
+      throw std::invalid_argument("unknown config key: " + key);
+    }
+  }
+
+  /**
+   * @brief Set the keys of a config file
+   *
+   */
+  static void load(std::filesystem::path const &path) {
+    std::ifstream file(path);
+    if (!file) {
+      throw std::invalid_argument("cannot read config " + path.string());
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+      line = line.substr(0, line.find('#'));
+      std::size_t const eq = line.find('=');
+      if (eq == std::string::npos) {
+        if (trim(line).empty()) {
+          continue;
+        }
+        throw std::invalid_argument("bad config line: " + line);
+      }
+      set(trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+    } // while
+  }
+
+private:
+  static std::string trim(std::string const &s) {
+    auto const space = [](char c) {
+      return std::isspace(static_cast<unsigned char>(c)) != 0;
+    };
+    std::size_t begin = 0, end = s.size();
+    while (begin < end && space(s[begin])) {
+      ++begin;
+    }
+    while (end > begin && space(s[end - 1])) {
+      --end;
+    }
+    return s.substr(begin, end - begin);
+  }
+}; // struct Config
@@ -6,6 +6,11 @@
 constexpr std::size_t kCacheSize = 1024 * 1024;           //!< 1MB cache size
 constexpr std::size_t kMemSize = 100 * 1024 * 1024;       //!< 100MB memory size
 constexpr uint64_t kSSDSize = 10ULL * 1024 * 1024 * 1024; //!< 10GB SSD size
+constexpr std::size_t kIoDepth = 4; //!< asynchronous requests per device
+constexpr std::size_t kIoAlign = 4096; //!< direct I/O buffer, offset and size
+constexpr std::size_t kExchangeBuffers = 4; //!< batches a pipeline runs ahead
+constexpr std::size_t kGenBlock = 256; //!< records generated by one task
+constexpr std::size_t kGenStreams = 64; //!< block b draws from stream b % 64
 
 constexpr char const *kSSD = "SSD";
 constexpr char const *kHDD = "HDD";
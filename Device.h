@@ -1,15 +1,26 @@
 #pragma once
 
+#include "Consts.h"
+#include "IoQueue.h"
+#include "IoTrace.h"
 #include <spdlog/spdlog.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
 #include <chrono>
 #include <climits>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <future>
+#include <memory>
 #include <string>
 #include <thread>
 
@@ -60,18 +71,162 @@ public:
 
 static inline std::filesystem::path kDir("data");
 
+/**
+ * @brief Path of \p file in kDir, creating kDir if it is missing
+ *
+ * Members opened from a constructor's initializer list run before its body,
+ * so they take their paths from here.
+ */
+static inline std::filesystem::path data_path(std::string const &file) {
+  if (std::filesystem::is_directory(kDir) == false) {
+    std::filesystem::create_directory(kDir);
+  }
+  return kDir / file;
+} // data_path
+
+/**
+ * @brief Buffer aligned to kIoAlign for direct I/O
+ *
+ */
+using AlignedBuffer = std::unique_ptr<char, decltype(&std::free)>;
+
+static inline AlignedBuffer aligned_buffer(std::size_t const bytes) {
+  std::size_t const size = (bytes + kIoAlign - 1) / kIoAlign * kIoAlign;
+  char *ptr = static_cast<char *>(std::aligned_alloc(kIoAlign, size));
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return AlignedBuffer(ptr, &std::free);
+} // aligned_buffer
+
+static inline bool io_aligned(void const *buffer, std::size_t const bytes,
+                              std::size_t const offset) {
+  return reinterpret_cast<std::uintptr_t>(buffer) % kIoAlign == 0 &&
+         bytes % kIoAlign == 0 && offset % kIoAlign == 0;
+} // io_aligned
+
+/**
+ * @brief Open \p path with O_DIRECT added to \p flags
+ *
+ * @return int descriptor, -1 if the file system refuses direct I/O
+ */
+static inline int open_direct(std::filesystem::path const &path,
+                              int const flags) {
+  int const fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+  if (fd < 0) {
+    spdlog::warn("{}: direct I/O unavailable, falling back to buffered I/O",
+                 path.string());
+  }
+  return fd;
+} // open_direct
+
+/**
+ * @brief pread until \p bytes are read or the end of file
+ *
+ * @return ::ssize_t bytes read, -1 on error
+ */
+static inline ::ssize_t pread_full(int const fd, char *buffer,
+                                   std::size_t const bytes,
+                                   std::size_t const offset) {
+  std::size_t count = 0;
+  while (count < bytes) {
+    ::ssize_t const ret =
+        ::pread(fd, buffer + count, bytes - count, offset + count);
+    if (ret < 0) {
+      return -1;
+    }
+    if (ret == 0) {
+      break;
+    }
+    count += ret;
+  } // while
+  return count;
+} // pread_full
+
+/**
+ * @brief pwrite all \p bytes
+ *
+ * @return ::ssize_t bytes written, -1 on error
+ */
+static inline ::ssize_t pwrite_full(int const fd, char const *buffer,
+                                    std::size_t const bytes,
+                                    std::size_t const offset) {
+  std::size_t count = 0;
+  while (count < bytes) {
+    ::ssize_t const ret =
+        ::pwrite(fd, buffer + count, bytes - count, offset + count);
+    if (ret <= 0) {
+      return -1;
+    }
+    count += ret;
+  } // while
+  return count;
+} // pwrite_full
+
 class Device {
 private:
-  double const _latency;       // in milliseconds
-  double const _bandwidth;     // in bytes per millisecond
-  std::size_t const _capacity; // capacity in bytes
-  std::size_t _used;           // used capacity in bytes
+  double const _latency;          // in milliseconds
+  double const _bandwidth;        // in bytes per millisecond
+  std::size_t const _capacity;    // capacity in bytes
+  std::atomic<std::size_t> _used; // used capacity in bytes
 
-  std::fstream _file;
-  Timer _timer; // for timing
+  int _fd;  // positioned reads / writes only, requests may overlap
+  int _dfd; // O_DIRECT descriptor of the same file, -1 when buffered
 
   std::size_t _base;
 
+  IoTrace _trace; // accesses, summarized at phase boundaries
+  IoQueue _queue; // asynchronous requests
+
+  /**
+   * @brief Read \p bytes at file position \p pos
+   *
+   * In direct mode unaligned requests read the covering aligned blocks into a
+   * bounce buffer, so reads never go through the page cache.
+   */
+  ::ssize_t transfer_read(char *buffer, std::size_t const bytes,
+                          std::size_t const pos) {
+    if (_dfd < 0) {
+      return pread_full(_fd, buffer, bytes, pos);
+    }
+    if (io_aligned(buffer, bytes, pos)) {
+      return pread_full(_dfd, buffer, bytes, pos);
+    }
+    std::size_t const begin = pos / kIoAlign * kIoAlign;
+    std::size_t const end = (pos + bytes + kIoAlign - 1) / kIoAlign * kIoAlign;
+    AlignedBuffer bounce = aligned_buffer(end - begin);
+    ::ssize_t const ret = pread_full(_dfd, bounce.get(), end - begin, begin);
+    if (ret < static_cast<::ssize_t>(pos + bytes - begin)) {
+      return -1;
+    }
+    std::memcpy(buffer, bounce.get() + (pos - begin), bytes);
+    return bytes;
+  }
+
+  /**
+   * @brief Write \p bytes at file position \p pos
+   *
+   * In direct mode unaligned requests are written through the page cache;
+   * the kernel keeps both views of the file coherent.
+   */
+  ::ssize_t transfer_write(char const *buffer, std::size_t const bytes,
+                           std::size_t const pos) {
+    if (_dfd >= 0 && io_aligned(buffer, bytes, pos)) {
+      return pwrite_full(_dfd, buffer, bytes, pos);
+    }
+    return pwrite_full(_fd, buffer, bytes, pos);
+  }
+
+  /**
+   * @brief Raise the used capacity to \p end
+   *
+   */
+  void extend(std::size_t const end) {
+    std::size_t used = _used.load();
+    while (used < end && !_used.compare_exchange_weak(used, end)) {
+    } // while
+  }
+
 protected:
   /**
    * @brief Read / Write Latency
@@ -92,21 +247,22 @@ public:
    * @param latency milliseconds
    * @param bandwidth MB/s
    * @param capacity MB
+   * @param depth number of asynchronous requests in flight
+   * @param direct bypass the page cache with O_DIRECT
    */
   Device(std::string name_, double const latency, double const bandwidth,
-         std::size_t const capacity)
+         std::size_t const capacity, std::size_t const depth = kIoDepth,
+         bool const direct = false)
       : _latency(latency), _bandwidth(bandwidth * 1e-3 * 1024 * 1024),
         _capacity(capacity == ULONG_MAX ? ULONG_MAX : capacity * 1024 * 1024),
-        _used(0), _base(0), name(name_) {
-    if (std::filesystem::is_directory(kDir) == false) {
-      std::filesystem::create_directory(kDir);
-    }
-    // Asynchronous I/O should relies on C++ async & future
-    _file.open(kDir / name, std::ios::in | std::ios::out | std::ios::binary |
-                                std::ios::trunc);
-    if (!_file.is_open()) {
+        _used(0), _base(0), _trace(data_path(name_ + ".iotrace"), name_),
+        _queue(depth), name(name_) {
+    _fd = ::open((kDir / name).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0) {
+      _queue.stop();
       throw std::runtime_error("Failed to open file");
     }
+    _dfd = direct ? open_direct(kDir / name, O_RDWR) : -1;
   }
 
   /**
@@ -122,31 +278,25 @@ public:
     if (offset + bytes + _base > _used) {
       return -1;
     }
-    spdlog::info("STATE -> READ_RUN_PAGES_{0}: Read sorted run pages from the "
-                 "{0} device",
-                 name);
-
-    _timer.start();
-    _file.seekg(offset + _base);
-    _file.read(buffer, bytes);
-    _timer.stop();
-    if (_file.fail() || _file.bad()) {
+    Timer timer;
+    timer.start();
+    ::ssize_t const count = transfer_read(buffer, bytes, offset + _base);
+    if (count < static_cast<::ssize_t>(bytes)) {
       return -1;
     }
+    timer.stop();
 
     double const reached = reach_time(bytes);
-    if (_timer.get_duration_ms() < reached) {
-      double const sleep_time = reached - _timer.get_duration_ms();
+    if (timer.get_duration_ms() < reached) {
+      double const sleep_time = reached - timer.get_duration_ms();
       std::size_t const sleep_time_us =
           static_cast<std::size_t>(sleep_time * 1000);
       std::this_thread::sleep_for(std::chrono::microseconds(sleep_time_us));
     }
 
-    spdlog::info(
-        "ACCESS -> A read to {} was made with size {} bytes and latency "
-        "{} us",
-        name, bytes, static_cast<std::size_t>(reached * 1000));
-    return _file.gcount();
+    _trace.record(IoEvent::Read, bytes,
+                  static_cast<std::size_t>(reached * 1000));
+    return count;
   }
 
   /**
@@ -162,39 +312,25 @@ public:
     if (bytes + offset + _base > _capacity) {
       return -1;
     }
-    spdlog::info("STATE -> SPILL_RUNS_{0}: Spill sorted runs to the {0} device",
-                 name);
-
-    _timer.start();
-    _file.clear();
-    _file.seekp(offset + _base);
-    _file.write(buffer, bytes);
-    _timer.stop();
-    if (_file.fail() || _file.bad()) {
+    Timer timer;
+    timer.start();
+    ::ssize_t const count = transfer_write(buffer, bytes, offset + _base);
+    if (count < 0) {
       return -1;
     }
-
-    std::size_t count = _file.tellp();
-    if (_used < count) {
-      _used = count;
-    }
-
-    count -= (offset + _base);
-
-    _file.flush();
+    extend(offset + _base + count);
+    timer.stop();
 
     double const reached = reach_time(bytes);
-    if (_timer.get_duration_ms() < reached) {
-      double const sleep_time = reached - _timer.get_duration_ms();
+    if (timer.get_duration_ms() < reached) {
+      double const sleep_time = reached - timer.get_duration_ms();
       std::size_t const sleep_time_us =
           static_cast<std::size_t>(sleep_time * 1000);
       std::this_thread::sleep_for(std::chrono::microseconds(sleep_time_us));
     }
 
-    spdlog::info(
-        "ACCESS -> A write to {} was made with size {} bytes and latency "
-        "{} us",
-        name, bytes, static_cast<std::size_t>(reached * 1000));
+    _trace.record(IoEvent::Write, bytes,
+                  static_cast<std::size_t>(reached * 1000));
     return count;
   }
 
@@ -206,41 +342,122 @@ public:
 
   std::size_t get_pos() const { return _used; }
 
+  std::size_t capacity() const { return _capacity; }
+
+  double latency() const { return _latency; }     // in milliseconds
+  double bandwidth() const { return _bandwidth; } // in bytes per millisecond
+
   void eseek(std::size_t const offset) { _used = offset; }
 
   void set_base(std::size_t const base) { _base = base; }
 
   std::size_t get_base() const { return _base; }
 
+  /**
+   * @brief Phase boundary: log the accesses since the last one
+   *
+   */
+  void trace_phase() { _trace.phase(); }
+
   /**
    * @brief Destroy the Device object
    *
    */
-  ~Device() { _file.close(); }
+  ~Device() {
+    _queue.stop();
+    if (_dfd >= 0) {
+      ::close(_dfd);
+    }
+    ::close(_fd);
+  }
+
+  bool direct() const { return _dfd >= 0; }
+
+  /**
+   * @brief Number of asynchronous requests served concurrently
+   *
+   */
+  std::size_t depth() const { return _queue.depth(); }
+
+  /**
+   * @brief Queue a read, \p done is called with what eread returns
+   *
+   * Requests are served by the device's I/O queue, each one is delayed by its
+   * own latency and transfer time.
+   */
+  void submit_read(char *buffer, std::size_t const bytes,
+                   std::size_t const offset, IoQueue::Completion done) {
+    _queue.submit([=] { return eread(buffer, bytes, offset); },
+                  std::move(done));
+  }
+
+  /**
+   * @brief Queue a write, \p done is called with what ewrite returns
+   *
+   */
+  void submit_write(char const *buffer, std::size_t const bytes,
+                    std::size_t const offset, IoQueue::Completion done) {
+    _queue.submit([=] { return ewrite(buffer, bytes, offset); },
+                  std::move(done));
+  }
 
   std::future<::ssize_t> async_eread(char *buffer, std::size_t const bytes,
                                      std::size_t const offset) {
-    return std::async(std::launch::async, &Device::eread, this, buffer, bytes,
-                      offset);
+    auto result = std::make_shared<std::promise<::ssize_t>>();
+    submit_read(buffer, bytes, offset,
+                [result](::ssize_t ret) { result->set_value(ret); });
+    return result->get_future();
   }
 
   std::future<::ssize_t> async_ewrite(char const *buffer,
                                       std::size_t const bytes,
                                       std::size_t const offset) {
-    return std::async(std::launch::async, &Device::ewrite, this, buffer, bytes,
-                      offset);
+    auto result = std::make_shared<std::promise<::ssize_t>>();
+    submit_write(buffer, bytes, offset,
+                 [result](::ssize_t ret) { result->set_value(ret); });
+    return result->get_future();
   }
 };
 
+/**
+ * @brief Sequential reader of a file
+ *
+ * In direct mode the file is read in kCacheSize aligned chunks with O_DIRECT
+ * and handed out from the chunk buffer.
+ */
 class ReadDevice {
 private:
   std::fstream _file;
 
+  int _dfd = -1;
+  AlignedBuffer _chunk{nullptr, &std::free};
+  std::size_t _chunk_pos = 0;  // next byte to hand out
+  std::size_t _chunk_size = 0; // bytes in the chunk
+  std::size_t _file_pos = 0;   // file position of the next chunk
+
+  bool refill() {
+    ::ssize_t const ret = pread_full(_dfd, _chunk.get(), kCacheSize, _file_pos);
+    if (ret <= 0) {
+      return false;
+    }
+    _file_pos += ret;
+    _chunk_pos = 0;
+    _chunk_size = ret;
+    return true;
+  }
+
 public:
-  ReadDevice(std::string name) {
+  ReadDevice(std::string name, bool const direct = false) {
     if (std::filesystem::is_directory(kDir) == false) {
       std::filesystem::create_directory(kDir);
     }
+    if (direct) {
+      _dfd = open_direct(kDir / name, O_RDONLY);
+    }
+    if (_dfd >= 0) {
+      _chunk = aligned_buffer(kCacheSize);
+      return;
+    }
     _file.open(kDir / name, std::ios::in | std::ios::binary);
     if (!_file.is_open()) {
       throw std::runtime_error("Failed to open file");
@@ -248,25 +465,99 @@ public:
   }
 
   ::ssize_t read_only(char *buffer, std::size_t const bytes) {
-    _file.read(buffer, bytes);
-    if (_file.fail() || _file.bad() || _file.eof()) {
-      return -1;
+    if (_dfd < 0) {
+      _file.read(buffer, bytes);
+      if (_file.fail() || _file.bad() || _file.eof()) {
+        return -1;
+      }
+      return _file.gcount();
     }
-    return _file.gcount();
+
+    std::size_t count = 0;
+    while (count < bytes) {
+      if (_chunk_pos == _chunk_size && !refill()) {
+        return -1;
+      }
+      std::size_t const n = std::min(bytes - count, _chunk_size - _chunk_pos);
+      std::memcpy(buffer + count, _chunk.get() + _chunk_pos, n);
+      _chunk_pos += n;
+      count += n;
+    } // while
+    return count;
+  }
+
+  /**
+   * @brief Read up to \p bytes, short at the end of the file
+   *
+   * @return ::ssize_t bytes read, 0 at the end of the file
+   */
+  ::ssize_t read_some(char *buffer, std::size_t const bytes) {
+    if (_dfd < 0) {
+      _file.read(buffer, bytes);
+      return _file.bad() ? -1 : _file.gcount();
+    }
+
+    std::size_t count = 0;
+    while (count < bytes) {
+      if (_chunk_pos == _chunk_size && !refill()) {
+        break;
+      }
+      std::size_t const n = std::min(bytes - count, _chunk_size - _chunk_pos);
+      std::memcpy(buffer + count, _chunk.get() + _chunk_pos, n);
+      _chunk_pos += n;
+      count += n;
+    } // while
+    return count;
   }
 
-  ~ReadDevice() { _file.close(); }
+  ~ReadDevice() {
+    if (_dfd >= 0) {
+      ::close(_dfd);
+    }
+    _file.close();
+  }
 };
 
+/**
+ * @brief Append-only writer of a file
+ *
+ * In direct mode appends are staged in a kCacheSize aligned chunk that is
+ * written with O_DIRECT when full. The last chunk is padded to kIoAlign and
+ * the file truncated back to its size.
+ */
 class WriteDevice {
 private:
   std::fstream _file;
 
+  int _dfd = -1;
+  AlignedBuffer _chunk{nullptr, &std::free};
+  std::size_t _chunk_size = 0; // staged bytes
+  std::size_t _file_pos = 0;   // file position of the chunk
+
+  bool drain() {
+    std::size_t const padded =
+        (_chunk_size + kIoAlign - 1) / kIoAlign * kIoAlign;
+    std::memset(_chunk.get() + _chunk_size, 0, padded - _chunk_size);
+    if (pwrite_full(_dfd, _chunk.get(), padded, _file_pos) < 0) {
+      return false;
+    }
+    _file_pos += _chunk_size;
+    _chunk_size = 0;
+    return true;
+  }
+
 public:
-  WriteDevice(std::string name) {
+  WriteDevice(std::string name, bool const direct = false) {
     if (std::filesystem::is_directory(kDir) == false) {
       std::filesystem::create_directory(kDir);
     }
+    if (direct) {
+      _dfd = open_direct(kDir / name, O_WRONLY | O_CREAT | O_TRUNC);
+    }
+    if (_dfd >= 0) {
+      _chunk = aligned_buffer(kCacheSize);
+      return;
+    }
     _file.open(kDir / name, std::ios::out | std::ios::binary | std::ios::trunc);
     if (!_file.is_open()) {
       throw std::runtime_error("Failed to open file");
@@ -274,13 +565,100 @@ public:
   }
 
   ::ssize_t append_only(char const *buffer, std::size_t const bytes) {
-    _file.write(buffer, bytes);
-    if (_file.fail() || _file.bad()) {
-      return -1;
+    if (_dfd < 0) {
+      _file.write(buffer, bytes);
+      if (_file.fail() || _file.bad()) {
+        return -1;
+      }
+      return bytes;
     }
-    _file.flush();
+
+    std::size_t count = 0;
+    while (count < bytes) {
+      std::size_t const n = std::min(bytes - count, kCacheSize - _chunk_size);
+      std::memcpy(_chunk.get() + _chunk_size, buffer + count, n);
+      _chunk_size += n;
+      count += n;
+      if (_chunk_size == kCacheSize && !drain()) {
+        return -1;
+      }
+    } // while
     return bytes;
   }
 
-  ~WriteDevice() { _file.close(); }
+  /**
+   * @brief Make the appends so far visible to readers of the file
+   *
+   * A partial direct I/O chunk is written padded and stays staged, it is
+   * rewritten in place once full.
+   */
+  void flush() {
+    if (_dfd < 0) {
+      _file.flush();
+      return;
+    }
+    if (_chunk_size > 0) {
+      std::size_t const staged = _chunk_size;
+      std::size_t const padded = (staged + kIoAlign - 1) / kIoAlign * kIoAlign;
+      std::memset(_chunk.get() + staged, 0, padded - staged);
+      if (pwrite_full(_dfd, _chunk.get(), padded, _file_pos) >= 0) {
+        ::ftruncate(_dfd, _file_pos + staged);
+      }
+    }
+  }
+
+  ~WriteDevice() {
+    if (_dfd >= 0) {
+      if (_chunk_size > 0 && drain()) {
+        ::ftruncate(_dfd, _file_pos);
+      }
+      ::close(_dfd);
+    }
+    _file.close();
+  }
+};
+
+/**
+ * @brief Read-only mapping of a whole file, advised for a sequential scan
+ *
+ * The kernel reads ahead aggressively and drops the pages behind the scan.
+ */
+class MappedFile {
+private:
+  char *_data = nullptr; // null if the file is empty
+  std::size_t _bytes = 0;
+
+public:
+  MappedFile(std::filesystem::path const &path) {
+    int const fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open file");
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || st.st_size == 0) {
+      ::close(fd);
+      return;
+    }
+    _bytes = st.st_size;
+    ::posix_fadvise(fd, 0, _bytes, POSIX_FADV_SEQUENTIAL);
+    void *const map = ::mmap(nullptr, _bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      throw std::runtime_error("Failed to map file");
+    }
+    ::madvise(map, _bytes, MADV_SEQUENTIAL);
+    _data = static_cast<char *>(map);
+  }
+
+  MappedFile(MappedFile const &) = delete;
+  MappedFile &operator=(MappedFile const &) = delete;
+
+  char const *data() const { return _data; }
+  std::size_t size() const { return _bytes; }
+
+  ~MappedFile() {
+    if (_data != nullptr) {
+      ::munmap(_data, _bytes);
+    }
+  }
 };
@@ -0,0 +1,94 @@
+#include "Exchange.h"
+#include "Consts.h"
+#include "Utils.h"
+#include "defs.h"
+#include <algorithm>
+#include <cstring>
+
+ExchangePlan::ExchangePlan(Plan *const input, RowCount const rows)
+    : _input(input), _rows(rows > 0 ? rows : cache_nrecords()) {
+  TRACE(true);
+} // ExchangePlan::ExchangePlan
+
+ExchangePlan::~ExchangePlan() {
+  TRACE(true);
+  delete _input;
+} // ExchangePlan::~ExchangePlan
+
+Iterator *ExchangePlan::init() const {
+  TRACE(true);
+  return new ExchangeIterator(this);
+} // ExchangePlan::init
+
+ExchangeIterator::ExchangeIterator(ExchangePlan const *const plan)
+    : _plan(plan), _input(plan->_input->init()), _full(kExchangeBuffers),
+      _free(kExchangeBuffers), _stop(false), _batch{0, 0}, _consumed(0),
+      _done(false) {
+  TRACE(true);
+  for (std::size_t i = 0; i < kExchangeBuffers; ++i) {
+    _buffers.emplace_back(
+        aligned_records(plan->_rows * Record_t::bytes), plan->_rows);
+    _free.try_push(i);
+  } // for
+  _producer = std::thread(&ExchangeIterator::produce, this);
+} // ExchangeIterator::ExchangeIterator
+
+ExchangeIterator::~ExchangeIterator() {
+  TRACE(true);
+  _stop = true; // the consumer may stop before the input ends
+  _free.wake();
+  _full.wake();
+  _producer.join();
+  delete _input;
+} // ExchangeIterator::~ExchangeIterator
+
+/**
+ * @brief Fill free buffers from the input until it ends
+ *
+ */
+void ExchangeIterator::produce() {
+  for (std::size_t buffer; _free.pop(buffer, _stop);) {
+    RowCount rows = 0;
+    try {
+      rows = _input->next_batch(_buffers[buffer], _plan->_rows);
+    } catch (...) {
+      _error = std::current_exception();
+    }
+    if (!_full.push({buffer, rows}, _stop) || rows == 0) {
+      return;
+    }
+  } // for
+} // ExchangeIterator::produce
+
+/**
+ * @brief Copy the next rows out of the buffers filled by the input
+ *
+ */
+RowCount ExchangeIterator::next_batch(RecordArr_t out, RowCount const max) {
+  TRACE(true);
+  RowCount n = 0;
+  while (n < max && !_done) {
+    if (_consumed == _batch.rows) {
+      if (_batch.rows > 0) {
+        _free.try_push(_batch.buffer); // never full, it holds all buffers
+      }
+      _full.pop(_batch, _stop);
+      _consumed = 0;
+      if (_batch.rows == 0) {
+        _done = true;
+        if (_error != nullptr) {
+          std::rethrow_exception(_error);
+        }
+        break;
+      }
+    }
+    RowCount const rows = std::min(max - n, _batch.rows - _consumed);
+    std::memcpy(reinterpret_cast<char *>((out + n).data()),
+                reinterpret_cast<char *>(
+                    (_buffers[_batch.buffer] + _consumed).data()),
+                rows * Record_t::bytes);
+    _consumed += rows;
+    n += rows;
+  } // while
+  return n;
+} // ExchangeIterator::next_batch
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Iterator.h"
+#include "Record.h"
+#include "SpscQueue.h"
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Runs its input plan on a thread of its own.
+ *
+ * The input fills buffers of \p rows records that pass to the consumer
+ * through a bounded single-producer single-consumer queue; emptied buffers
+ * go back to the producer through a second queue. All buffers are allocated
+ * when the iterator starts, so the steady state allocates nothing. The input
+ * runs ahead by at most kExchangeBuffers batches.
+ */
+class ExchangePlan : public Plan {
+  friend class ExchangeIterator;
+
+public:
+  /**
+   * @brief Construct a new ExchangePlan object
+   *
+   * @param rows records of a buffer, defaults to a cache run
+   */
+  ExchangePlan(Plan *const input, RowCount const rows = 0);
+  ~ExchangePlan();
+  Iterator *init() const override;
+  RecordArr_t const &records() const override { return _input->records(); }
+  Record_t const &witnessRecord() const override {
+    return _input->witnessRecord();
+  }
+
+private:
+  Plan *const _input;
+  RowCount const _rows;
+}; // class ExchangePlan
+
+class ExchangeIterator : public Iterator {
+public:
+  ExchangeIterator(ExchangePlan const *const plan);
+  ~ExchangeIterator();
+  RowCount next_batch(RecordArr_t out, RowCount const max) override;
+
+private:
+  struct Batch {
+    std::size_t buffer;
+    RowCount rows; // 0 ends the input
+  };
+
+  void produce();
+
+  ExchangePlan const *const _plan;
+  Iterator *const _input;
+  std::vector<RecordArr_t> _buffers;
+  SpscQueue<Batch> _full;
+  SpscQueue<std::size_t> _free;
+  std::atomic<bool> _stop;
+  std::exception_ptr _error; // thrown by the input, published by the end
+  std::thread _producer;
+
+  Batch _batch;       // buffer being consumed
+  RowCount _consumed; // rows of _batch handed out
+  bool _done;
+}; // class ExchangeIterator
@@ -1,6 +1,9 @@
 #include <spdlog/sinks/basic_file_sink.h>
 #include <spdlog/spdlog.h>
 
+#include "Config.h"
+#include "Exchange.h"
+#include "FileScan.h"
 #include "Iterator.h"
 #include "Record.h"
 #include "Scan.h"
@@ -8,24 +11,39 @@
 #include "Utils.h"
 #include "Validate.h"
 #include "defs.h"
+#include <algorithm>
 
 int main(int argc, char *argv[]) {
   TRACE(true);
 
   std::size_t nRecords = 0;
   std::string tracefile = "/dev/stdout";
+  std::string input; // sort the records of a file instead of random ones
 
   for (int i = 1; i < argc; ++i) {
     if (std::string(argv[i]) == "-c") {
       nRecords = std::stoul(argv[++i]);
     } else if (std::string(argv[i]) == "-s") {
       Record_t::bytes = std::stoul(argv[++i]);
+    } else if (std::string(argv[i]) == "-i" && i + 1 < argc) {
+      input = argv[++i];
     } else if (std::string(argv[i]) == "-o") {
       tracefile = kDir / argv[++i];
+    } else if (std::string(argv[i]) == "--config" && i + 1 < argc) {
+      Config::load(argv[++i]);
+    } else if (std::string(argv[i]).rfind("--", 0) == 0 && i + 1 < argc) {
+      // --cache-size 32M sets the config key cache_size
+      std::string key = std::string(argv[i]).substr(2);
+      std::replace(key.begin(), key.end(), '-', '_');
+      Config::set(key, argv[++i]);
     } else {
       throw std::invalid_argument("unknown option");
     }
   } // for
+  check_hierarchy();
+  if (!input.empty()) {
+    nRecords = FileScanPlan::count(input);
+  }
 
   auto file_logger = spdlog::basic_logger_mt("basic_logger", tracefile, true);
   spdlog::set_default_logger(file_logger);
@@ -34,6 +52,9 @@ int main(int argc, char *argv[]) {
   printf("=======================\n");
   printf("# of records: %lu\n", nRecords);
   printf("# of bytes in record: %lu\n", Record_t::bytes);
+  printf("# of bytes in cache: %lu\n", Config::cache_size);
+  printf("# of bytes in memory: %lu\n", Config::mem_size);
+  printf("# of bytes in SSD: %lu\n", (unsigned long)Config::ssd_size);
   printf("# of records in one cache run: %lu\n", cache_nrecords());
   printf("# of cache runs in memory: %lu\n", mem_nruns());
   printf("# of records in one memory run: %lu\n", mem_nrecords());
@@ -42,7 +63,18 @@ int main(int argc, char *argv[]) {
   printf("# of records in one SSD run: %lu\n", ssd_nrecords());
   printf("=======================\n");
 
-  Plan *const plan = new ValidatePlan(new SortPlan(new ScanPlan(nRecords)));
+  Plan *const scan = input.empty()
+                         ? static_cast<Plan *>(new ScanPlan(nRecords))
+                         : new FileScanPlan(input);
+  // exchanges overlap generation with sorting and reading the output with
+  // its validation; a scan batch has a block for every generator thread
+  RowCount const scan_rows =
+      std::max<RowCount>(cache_nrecords(), genThreads() * kGenBlock);
+  Plan *const plan =
+      isPipelined()
+          ? new ValidatePlan(new ExchangePlan(
+                new SortPlan(new ExchangePlan(scan, scan_rows))))
+          : new ValidatePlan(new SortPlan(scan));
 
   Iterator *const it = plan->init();
   it->run();
@@ -0,0 +1,61 @@
+#include "FileScan.h"
+#include "Utils.h"
+#include "Witness.h"
+#include "defs.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+FileScanPlan::FileScanPlan(std::string const &path)
+    : _path(path), _count(count(path)),
+      _rcache(aligned_records(Config::cache_size), fcache_nrecords()),
+      _inputWitnessRecord(new Record_t) {
+  TRACE(true);
+  _inputWitnessRecord->fill(0);
+} // FileScanPlan::FileScanPlan
+
+FileScanPlan::~FileScanPlan() { TRACE(true); } // FileScanPlan::~FileScanPlan
+
+Iterator *FileScanPlan::init() const {
+  TRACE(true);
+  return new FileScanIterator(this);
+} // FileScanPlan::init
+
+RowCount FileScanPlan::count(std::string const &path) {
+  std::uintmax_t const bytes = std::filesystem::file_size(path);
+  if (bytes % Record_t::bytes != 0) {
+    throw std::invalid_argument("input file is not made of whole records");
+  }
+  return bytes / Record_t::bytes;
+} // FileScanPlan::count
+
+FileScanIterator::FileScanIterator(FileScanPlan const *const plan)
+    : _plan(plan), _count(0), _map(plan->_path) {
+  TRACE(true);
+} // FileScanIterator::FileScanIterator
+
+FileScanIterator::~FileScanIterator() {
+  TRACE(true);
+  traceprintf("produced %lu of %lu rows\n", (unsigned long)(_count),
+              (unsigned long)(_plan->_count));
+} // FileScanIterator::~FileScanIterator
+
+/**
+ * @brief Copy the next rows out of the mapping
+ *
+ */
+RowCount FileScanIterator::next_batch(RecordArr_t out, RowCount const max) {
+  TRACE(true);
+
+  RowCount const n = std::min(max, _plan->_count - _count);
+  if (n == 0) {
+    return 0;
+  }
+  std::memcpy(reinterpret_cast<char *>(out.data()),
+              _map.data() + _count * Record_t::bytes, n * Record_t::bytes);
+  // witness for input
+  witness_xor(*(_plan->_inputWitnessRecord.get()), out, n);
+  _count += n;
+  return n;
+} // FileScanIterator::next_batch
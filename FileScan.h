@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Device.h"
+#include "Iterator.h"
+#include "Record.h"
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/**
+ * @brief Scan of an existing file of fixed-size records.
+ *
+ * The file is mapped read-only and read ahead sequentially; every batch is
+ * one copy out of the mapping. The input witness is the XOR of the records,
+ * as for generated input, so ValidatePlan checks file sorts the same way.
+ */
+class FileScanPlan : public Plan {
+  friend class FileScanIterator;
+
+public:
+  /**
+   * @brief Construct a new FileScanPlan object
+   *
+   * @param path of the input file, a multiple of Record_t::bytes
+   */
+  FileScanPlan(std::string const &path);
+  ~FileScanPlan();
+  Iterator *init() const override;
+  RecordArr_t const &records() const override { return _rcache; }
+  Record_t const &witnessRecord() const override {
+    return *(_inputWitnessRecord.get());
+  }
+
+  /**
+   * @brief Records in the file at \p path
+   *
+   */
+  static RowCount count(std::string const &path);
+
+private:
+  std::string const _path;
+  RowCount const _count;
+  // Cache-resident records
+  RecordArr_t const _rcache;
+  std::unique_ptr<Record_t> const _inputWitnessRecord;
+}; // class FileScanPlan
+
+class FileScanIterator : public Iterator {
+public:
+  FileScanIterator(FileScanPlan const *const plan);
+  ~FileScanIterator();
+  RowCount next_batch(RecordArr_t out, RowCount const max) override;
+
+private:
+  FileScanPlan const *const _plan;
+  RowCount _count;
+  MappedFile const _map;
+}; // class FileScanIterator
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Record.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+/**
+ * @brief Record operations for records of \p Bytes bytes known at compile
+ * time, or of Record_t::bytes for \p Bytes 0.
+ *
+ * With a fixed size, compares and short copies are memcmp and memcpy of a
+ * constant length the compiler expands inline, and the records of an array
+ * sit at a constant stride without the range check of RecordArr::operator[].
+ */
+template <std::size_t Bytes> struct FixedRecord {
+  static constexpr std::size_t kInlineCopy = 128; //!< longest inline copy
+
+  static std::size_t bytes() { return Bytes > 0 ? Bytes : Record_t::bytes; }
+
+  static Record_t &at(RecordArr_t const &records, std::size_t const i) {
+    return *reinterpret_cast<Record_t *>(
+        reinterpret_cast<char *>(records.data()) + i * bytes());
+  }
+
+  static bool less(Record_t const &a, Record_t const &b) {
+    return std::memcmp(a.key, b.key, bytes()) < 0;
+  }
+
+  static void copy(Record_t &to, Record_t const &from) {
+    if constexpr (Bytes > 0 && Bytes <= kInlineCopy) {
+      std::memcpy(to.key, from.key, Bytes);
+    } else {
+      to = from; // the library copy beats an expanded one for long records
+    }
+  }
+
+  static void swap(Record_t &a, Record_t &b) {
+    std::swap_ranges(a.key, a.key + bytes(), b.key);
+  }
+}; // struct FixedRecord
+
+/**
+ * @brief Call \p fn with the FixedRecord of Record_t::bytes, the generic
+ * FixedRecord<0> for the sizes without an instantiation of their own
+ *
+ */
+template <typename Fn> decltype(auto) with_record_size(Fn &&fn) {
+  switch (Record_t::bytes) {
+  case 16:
+    return fn(FixedRecord<16>());
+  case 100:
+    return fn(FixedRecord<100>());
+  case 128:
+    return fn(FixedRecord<128>());
+  case 1024:
+    return fn(FixedRecord<1024>());
+  default:
+    return fn(FixedRecord<0>());
+  }
+} // with_record_size
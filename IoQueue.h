@@ -0,0 +1,104 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Submission queue served by a fixed number of I/O workers.
+ *
+ * Up to \p depth requests are in flight at the same time, the others wait in
+ * submission order. Every request reports its result to a completion
+ * callback, which runs on the worker thread that served it.
+ */
+class IoQueue {
+public:
+  using Request = std::function<::ssize_t()>;
+  using Completion = std::function<void(::ssize_t)>;
+
+private:
+  struct Entry {
+    Request request;
+    Completion done;
+  };
+
+  std::mutex _lock;
+  std::condition_variable _ready;
+  std::deque<Entry> _entries;
+  std::vector<std::thread> _workers;
+  bool _stopped = false;
+
+  void serve() {
+    for (;;) {
+      Entry entry;
+      {
+        std::unique_lock<std::mutex> lock(_lock);
+        _ready.wait(lock, [this] { return _stopped || !_entries.empty(); });
+        if (_entries.empty()) {
+          return; // stopped and drained
+        }
+        entry = std::move(_entries.front());
+        _entries.pop_front();
+      }
+      ::ssize_t const result = entry.request();
+      if (entry.done) {
+        entry.done(result);
+      }
+    } // for
+  }
+
+public:
+  /**
+   * @brief Construct a new IoQueue object
+   *
+   * @param depth number of requests served concurrently
+   */
+  explicit IoQueue(std::size_t const depth) {
+    for (std::size_t i = 0; i < (depth > 0 ? depth : 1); ++i) {
+      _workers.emplace_back(&IoQueue::serve, this);
+    } // for
+  }
+
+  IoQueue(IoQueue const &) = delete;
+  IoQueue &operator=(IoQueue const &) = delete;
+
+  /**
+   * @brief Queue \p request, \p done is called with its result
+   *
+   */
+  void submit(Request request, Completion done) {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _entries.push_back({std::move(request), std::move(done)});
+    }
+    _ready.notify_one();
+  }
+
+  std::size_t depth() const { return _workers.size(); }
+
+  /**
+   * @brief Serve the queued requests, then join the workers
+   *
+   */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      if (_stopped) {
+        return;
+      }
+      _stopped = true;
+    }
+    _ready.notify_all();
+    for (auto &worker : _workers) {
+      worker.join();
+    } // for
+  }
+
+  ~IoQueue() { stop(); }
+}; // class IoQueue
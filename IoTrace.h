@@ -0,0 +1,169 @@
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief One device access as stored in the binary event log
+ *
+ */
+struct IoEvent {
+  enum Kind : uint32_t {
+    Read = 0,  //!< STATE READ_RUN_PAGES
+    Write = 1, //!< STATE SPILL_RUNS
+  };
+  uint64_t time_us;    //!< completion time, microseconds since the epoch
+  uint64_t bytes;      //!< request size
+  uint32_t latency_us; //!< emulated latency
+  uint32_t kind;       //!< Kind
+}; // struct IoEvent
+
+/**
+ * @brief Batched I/O accounting of one device.
+ *
+ * Accesses are counted in memory and appended to a binary event log instead
+ * of being formatted one by one. At a phase boundary the counters are logged
+ * as one STATE / ACCESS summary per access kind, and the buffered events are
+ * written out. The log starts with kMagic and the device name; the
+ * IoTraceExpand tool turns it back into the per-access trace lines.
+ */
+class IoTrace {
+public:
+  static constexpr char kMagic[8] = {'I', 'O', 'T', 'R', 'A', 'C', 'E', '1'};
+  static constexpr std::size_t kMaxEvents = 4096; //!< events kept in memory
+
+private:
+  struct Counter {
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> latency_us{0};
+  };
+
+  std::string const _device;
+  Counter _counters[2]; // by IoEvent::Kind, since the last phase boundary
+
+  std::mutex _lock; // events and log
+  std::vector<IoEvent> _events;
+  std::ofstream _log;
+
+  void write_events() {
+    if (!_events.empty() && _log.is_open()) {
+      _log.write(reinterpret_cast<char const *>(_events.data()),
+                 _events.size() * sizeof(IoEvent));
+    }
+    _events.clear();
+  }
+
+public:
+  /**
+   * @brief Construct a new IoTrace object
+   *
+   * @param path binary event log, truncated
+   * @param device device name used in the trace lines
+   */
+  IoTrace(std::filesystem::path const &path, std::string const &device)
+      : _device(device),
+        _log(path, std::ios::out | std::ios::binary | std::ios::trunc) {
+    _events.reserve(kMaxEvents);
+    if (_log.is_open()) {
+      uint32_t const length = _device.size();
+      _log.write(kMagic, sizeof(kMagic));
+      _log.write(reinterpret_cast<char const *>(&length), sizeof(length));
+      _log.write(_device.data(), length);
+    }
+  }
+
+  IoTrace(IoTrace const &) = delete;
+  IoTrace &operator=(IoTrace const &) = delete;
+
+  ~IoTrace() { phase(); }
+
+  /**
+   * @brief Account one access
+   *
+   */
+  void record(IoEvent::Kind const kind, std::size_t const bytes,
+              std::size_t const latency_us) {
+    Counter &counter = _counters[kind];
+    ++counter.requests;
+    counter.bytes += bytes;
+    counter.latency_us += latency_us;
+
+    auto const since = std::chrono::system_clock::now().time_since_epoch();
+    uint64_t const now =
+        std::chrono::duration_cast<std::chrono::microseconds>(since).count();
+    std::lock_guard<std::mutex> lock(_lock);
+    _events.push_back({now, bytes, static_cast<uint32_t>(latency_us), kind});
+    if (_events.size() == kMaxEvents) {
+      write_events();
+    }
+  }
+
+  /**
+   * @brief Phase boundary: log the summaries and write out the events
+   *
+   */
+  void phase() {
+    uint64_t const reads = _counters[IoEvent::Read].requests.exchange(0);
+    uint64_t const read_bytes = _counters[IoEvent::Read].bytes.exchange(0);
+    uint64_t const read_us = _counters[IoEvent::Read].latency_us.exchange(0);
+    if (reads > 0) {
+      spdlog::info("STATE -> READ_RUN_PAGES_{0}: Read sorted run pages from "
+                   "the {0} device",
+                   _device);
+      spdlog::info("ACCESS -> {1} reads to {0} were made with size {2} bytes "
+                   "and latency {3} us",
+                   _device, reads, read_bytes, read_us);
+    }
+    uint64_t const writes = _counters[IoEvent::Write].requests.exchange(0);
+    uint64_t const write_bytes = _counters[IoEvent::Write].bytes.exchange(0);
+    uint64_t const write_us = _counters[IoEvent::Write].latency_us.exchange(0);
+    if (writes > 0) {
+      spdlog::info(
+          "STATE -> SPILL_RUNS_{0}: Spill sorted runs to the {0} device",
+          _device);
+      spdlog::info("ACCESS -> {1} writes to {0} were made with size {2} bytes "
+                   "and latency {3} us",
+                   _device, writes, write_bytes, write_us);
+    }
+
+    std::lock_guard<std::mutex> lock(_lock);
+    write_events();
+    _log.flush();
+  }
+
+  /**
+   * @brief Read a binary event log
+   *
+   * @return false if \p path is not an event log
+   */
+  static bool load(std::filesystem::path const &path, std::string &device,
+                   std::vector<IoEvent> &events) {
+    std::ifstream log(path, std::ios::in | std::ios::binary);
+    char magic[sizeof(kMagic)];
+    uint32_t length = 0;
+    if (!log.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 ||
+        !log.read(reinterpret_cast<char *>(&length), sizeof(length))) {
+      return false;
+    }
+    device.resize(length);
+    if (!log.read(device.data(), length)) {
+      return false;
+    }
+    IoEvent event;
+    while (log.read(reinterpret_cast<char *>(&event), sizeof(event))) {
+      events.push_back(event);
+    } // while
+    return true;
+  }
+}; // class IoTrace
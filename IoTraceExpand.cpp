@@ -0,0 +1,67 @@
+#include "IoTrace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Expand binary device event logs into per-access trace lines
+ *
+ * Usage: IoTraceExpand.exe data/SSD.iotrace [data/HDD.iotrace ...]
+ *
+ * The events of all logs are printed in time order as the STATE / ACCESS
+ * line pairs of the per-access trace.
+ */
+int main(int argc, char *argv[]) {
+  std::vector<std::pair<IoEvent, std::string const *>> events;
+  std::vector<std::string> devices(argc > 1 ? argc - 1 : 0);
+
+  for (int i = 1; i < argc; ++i) {
+    std::vector<IoEvent> log;
+    if (!IoTrace::load(argv[i], devices[i - 1], log)) {
+      std::fprintf(stderr, "%s: not an I/O event log\n", argv[i]);
+      return 1;
+    }
+    for (IoEvent const &event : log) {
+      events.emplace_back(event, &devices[i - 1]);
+    } // for
+  } // for
+
+  std::stable_sort(events.begin(), events.end(),
+                   [](auto const &a, auto const &b) {
+                     return a.first.time_us < b.first.time_us;
+                   });
+
+  for (auto const &[event, device] : events) {
+    std::time_t const seconds = event.time_us / 1000000;
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%H:%M:%S", std::localtime(&seconds));
+    char const *const name = device->c_str();
+    if (event.kind == IoEvent::Read) {
+      std::printf("[%s.%06lu][info] STATE -> READ_RUN_PAGES_%s: Read sorted "
+                  "run pages from the %s device\n",
+                  stamp, static_cast<unsigned long>(event.time_us % 1000000),
+                  name, name);
+      std::printf("[%s.%06lu][info] ACCESS -> A read to %s was made with size "
+                  "%lu bytes and latency %u us\n",
+                  stamp, static_cast<unsigned long>(event.time_us % 1000000),
+                  name, static_cast<unsigned long>(event.bytes),
+                  event.latency_us);
+    } else {
+      std::printf("[%s.%06lu][info] STATE -> SPILL_RUNS_%s: Spill sorted runs "
+                  "to the %s device\n",
+                  stamp, static_cast<unsigned long>(event.time_us % 1000000),
+                  name, name);
+      std::printf("[%s.%06lu][info] ACCESS -> A write to %s was made with size "
+                  "%lu bytes and latency %u us\n",
+                  stamp, static_cast<unsigned long>(event.time_us % 1000000),
+                  name, static_cast<unsigned long>(event.bytes),
+                  event.latency_us);
+    }
+  } // for
+
+  return 0;
+} // main
@@ -6,15 +6,21 @@ Plan::Plan() { TRACE(true); } // Plan::Plan
 
 Plan::~Plan() { TRACE(true); } // Plan::~Plan
 
-Iterator::Iterator() : _count(0) { TRACE(true); } // Iterator::Iterator
+Iterator::Iterator() : _count(0), _row(1) {
+  TRACE(true);
+} // Iterator::Iterator
 
 Iterator::~Iterator() { TRACE(true); } // Iterator::~Iterator
 
+bool Iterator::next() { return next_batch(_row, 1) > 0; } // Iterator::next
+
 void Iterator::run() {
   TRACE(true);
 
-  while (next())
-    ++_count;
+  RecordArr_t batch(out_nrecords());
+  for (RowCount n; (n = next_batch(batch, batch.size())) > 0;) {
+    _count += n;
+  } // for
 
   traceprintf("entire plan produced SORTED %lu%s rows\n", (unsigned long)_count,
               (isDistinct() ? " UNIQUE" : ""));
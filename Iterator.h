@@ -22,8 +22,23 @@ public:
   Iterator();
   virtual ~Iterator();
   void run();
-  virtual bool next() = 0;
+
+  /**
+   * @brief Produce the next rows into \p out
+   *
+   * @param max rows wanted, at most out.size()
+   * @return RowCount rows produced, 0 once the rows are exhausted
+   */
+  virtual RowCount next_batch(RecordArr_t out, RowCount const max) = 0;
+
+  /**
+   * @brief Single-row adapter of next_batch, the row is in row()
+   *
+   */
+  bool next();
+  Record_t const &row() const { return _row[0]; }
 
 private:
   RowCount _count;
+  RecordArr_t _row;
 }; // class Iterator
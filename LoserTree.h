@@ -1,10 +1,20 @@
+#pragma once
+
 #include "Record.h"
 #include "defs.h"
 
 typedef unsigned int RunId;
 typedef unsigned int RecordId;
 typedef int Level;
+typedef uint32_t Ovc;
 
+/**
+ * @brief Tree of losers over MergeInd candidates.
+ *
+ * Every candidate carries an offset-value code. \p Compare takes both
+ * candidates by reference and may re-code the loser of a match against the
+ * winner, so a code-aware comparator decides most matches on the codes alone.
+ */
 template <typename Compare> class LoserTree {
   Level const height;
   Index_r heap;
@@ -20,6 +30,7 @@ public:
       // MergeInd temp = {cap + 1, early_fence(i)};
       heap[i].record_id = early_fence(i);
       heap[i].run_id = cap + 1;
+      heap[i].ovc = 0;
     }
   }
   ~LoserTree() = default;
@@ -74,8 +85,8 @@ public:
   }
   RecordId early_fence(RunId index) const { return RecordId(index); }
   RecordId late_fence(RunId index) const { return ~RecordId(index); }
-  void pass(RunId index, RecordId key) {
-    MergeInd candidate = {index, key};
+  void pass(RunId index, RecordId key, Ovc ovc = 0) {
+    MergeInd candidate = {index, key, ovc};
     RunId slot;
     for (leaf(index, slot); parent(slot) != 0;) {
       if (heap[slot].run_id > capacity()) {
@@ -111,10 +122,14 @@ public:
   MergeInd top() { return poptop(false); }
   MergeInd pop() { return poptop(true); }
 
-  void push(RunId index, RecordId key) {
-    pass(index, early_fence(capacity()) + key);
+  void push(RunId index, RecordId key, Ovc ovc = 0) {
+    pass(index, early_fence(capacity()) + key, ovc);
+  }
+  void insert(RunId index, RecordId key, Ovc ovc = 0) {
+    push(index, key, ovc);
+  }
+  void update(RunId index, RecordId key, Ovc ovc = 0) {
+    push(index, key, ovc);
   }
-  void insert(RunId index, RecordId key) { push(index, key); }
-  void update(RunId index, RecordId key) { push(index, key); }
   void deleteRecordId(RunId index) { pass(index, late_fence(index)); }
 };
@@ -0,0 +1,578 @@
+#pragma once
+
+#include "Device.h"
+#include "Iterator.h"
+#include "LoserTree.h"
+#include "Record.h"
+#include "SortFunc.h"
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * @brief Offset-value code of \p rec against \p base
+ *
+ * Codes of records not smaller than \p base order like the records: a longer
+ * common prefix gives a smaller code, at equal offsets the smaller byte wins.
+ * Equal records code to 0.
+ */
+static inline Ovc ovc_encode(Record_t const &rec, Record_t const &base) {
+  std::size_t const bytes = Record_t::bytes;
+  std::size_t offset = 0;
+  while (offset < bytes && rec.key[offset] == base.key[offset]) {
+    ++offset;
+  } // while
+  if (offset == bytes) {
+    return 0;
+  }
+  return static_cast<Ovc>((bytes - offset) << 8 | rec.key[offset]);
+} // ovc_encode
+
+/**
+ * @brief Offset-value code of \p rec against the all-zero record
+ *
+ * Used for the initial tournament, before anything has been output.
+ */
+static inline Ovc ovc_encode(Record_t const &rec) {
+  std::size_t const bytes = Record_t::bytes;
+  std::size_t offset = 0;
+  while (offset < bytes && rec.key[offset] == 0) {
+    ++offset;
+  } // while
+  if (offset == bytes) {
+    return 0;
+  }
+  return static_cast<Ovc>((bytes - offset) << 8 | rec.key[offset]);
+} // ovc_encode
+
+/**
+ * @brief Loser tree comparator with offset-value coding
+ *
+ * Both candidates are coded against the same record. Unequal codes decide the
+ * match, equal codes resume the byte comparison after the coded offset and
+ * re-code the loser against the winner. Runs past \p n_runs are padding.
+ */
+template <typename GetRecord>
+static inline auto ovc_cmp(GetRecord const &get_record, RowCount const n_runs) {
+  return [&get_record, n_runs](MergeInd &a, MergeInd &b) {
+    if (a.run_id >= n_runs) {
+      return false;
+    } else if (b.run_id >= n_runs) {
+      return true;
+    }
+    if (a.ovc != b.ovc) {
+      return a.ovc < b.ovc;
+    }
+
+    std::size_t const bytes = Record_t::bytes;
+    Record_t const &ra = get_record(a);
+    Record_t const &rb = get_record(b);
+    std::size_t offset = a.ovc == 0 ? bytes : bytes - (a.ovc >> 8) + 1;
+    while (offset < bytes && ra.key[offset] == rb.key[offset]) {
+      ++offset;
+    } // while
+    if (offset == bytes) {
+      a.ovc = 0; // b wins ties
+      return false;
+    }
+
+    bool const less = ra.key[offset] < rb.key[offset];
+    MergeInd &loser = less ? b : a;
+    Record_t const &rl = less ? rb : ra;
+    loser.ovc = static_cast<Ovc>((bytes - offset) << 8 | rl.key[offset]);
+    return less;
+  };
+} // ovc_cmp
+
+/**
+ * @brief Run source: sorted runs laid out back to back in memory.
+ *
+ * A run source tells the merge how many runs there are, where the current
+ * record of a run lives and how to step a run forward:
+ *   RowCount n_runs() const;
+ *   Record_t const &get(MergeInd const &mind) const; // current record only
+ *   bool next(MergeInd &mind); // false once the run is exhausted
+ * The device sources keep a cursor per run, so get() is a single load and
+ * next() only does page arithmetic when a page is used up.
+ */
+struct MemRunSource {
+  RecordView_t const records;
+  RowCount const run_size;
+  RowCount const runs;
+
+  MemRunSource(RecordArr_t const &records_, RowCount const run_size_,
+               RowCount const runs_)
+      : records(records_.view()), run_size(run_size_), runs(runs_) {}
+
+  RowCount n_runs() const { return runs; }
+  Record_t const &get(MergeInd const &mind) const {
+    return records[mind.run_id * run_size + mind.record_id];
+  }
+  bool next(MergeInd &mind) { return ++mind.record_id < run_size; }
+}; // struct MemRunSource
+
+/**
+ * @brief Run source: memory runs with some runs spilled to a device.
+ *
+ * The first \p n_runs_spill memory runs give up their second half to the
+ * spilled runs. Each of them is then merged as two half-sized runs whose
+ * pages are refilled from the device.
+ */
+struct SpillMemSource {
+  RecordArr_t &records;
+  RecordView_t const view; // unchecked records
+  Device *const dev;
+  RowCount const mem_run_size;
+  RowCount const half_size;
+  RowCount const n_runs_spill;
+  RowCount const runs;
+  std::vector<char const *> cur; // current record of each run
+
+  SpillMemSource(RecordArr_t &records_, Device *dev_,
+                 RowCount const mem_run_size_, RowCount const n_runs_mem,
+                 RowCount const n_runs_spill_)
+      : records(records_), view(records_.view()), dev(dev_),
+        mem_run_size(mem_run_size_),
+        half_size(mem_run_size_ / 2), n_runs_spill(n_runs_spill_),
+        runs(n_runs_mem + n_runs_spill_), cur(runs) {
+    for (RunId run = 0; run < runs; ++run) {
+      cur[run] = first(run);
+    } // for
+  }
+
+  char const *first(RunId const run) const {
+    if (run < 2 * n_runs_spill) {
+      return view[run * half_size];
+    }
+    return view[2 * n_runs_spill * half_size +
+                (run - 2 * n_runs_spill) * mem_run_size];
+  }
+
+  /**
+   * @brief Make space for the spilled runs
+   *
+   */
+  void open() {
+    for (uint32_t i = 0; i < n_runs_spill; ++i) {
+      char *exchange = records[i * mem_run_size + half_size];
+      dev->eappend(exchange, half_size * Record_t::bytes);
+      dev->eread(exchange, half_size * Record_t::bytes,
+                 (i * mem_run_size) * Record_t::bytes);
+    } // for
+  }
+
+  RowCount n_runs() const { return runs; }
+  Record_t const &get(MergeInd const &mind) const {
+    return *reinterpret_cast<Record_t const *>(cur[mind.run_id]);
+  }
+  bool next(MergeInd &mind) {
+    ++mind.record_id;
+    if (mind.run_id < 2 * n_runs_spill && mind.record_id % half_size == 0 &&
+        mind.record_id < mem_run_size) {
+      uint64_t offset =
+          mind.run_id % 2
+              ? ((mind.run_id / 2) * mem_run_size) + half_size
+              : mem_run_size * n_runs_spill + ((mind.run_id / 2) * half_size);
+      dev->eread(records[mind.run_id * half_size],
+                 half_size * Record_t::bytes, offset * Record_t::bytes);
+      cur[mind.run_id] = first(mind.run_id);
+    } else {
+      cur[mind.run_id] += Record_t::bytes;
+    }
+    return mind.record_id < mem_run_size;
+  }
+}; // struct SpillMemSource
+
+/**
+ * @brief Run source: device-resident runs read one page at a time.
+ *
+ * Every run owns a page of \p page_size records in \p records and is refilled
+ * from its device whenever the page is used up. Runs hold \p run_size records
+ * unless added with their own size.
+ */
+struct PagedRunSource {
+  struct Run {
+    Device *dev;
+    RowCount offset;   // first record of the run on the device
+    RowCount size;     // number of records in the run
+    RowCount page_end; // first record past the loaded page
+  };
+
+  RecordArr_t &records;
+  RecordView_t const view; // unchecked records
+  RowCount const page_size;
+  RowCount const run_size;
+  std::vector<Run> runs;
+  std::vector<char const *> cur; // current record of each run
+
+  PagedRunSource(RecordArr_t &records_, RowCount const page_size_,
+                 RowCount const run_size_)
+      : records(records_), view(records_.view()), page_size(page_size_),
+        run_size(run_size_) {}
+
+  void add(Device *dev, RowCount const offset) { add(dev, offset, run_size); }
+  void add(Device *dev, RowCount const offset, RowCount const size) {
+    runs.push_back({dev, offset, size, 0});
+    cur.push_back(nullptr);
+  }
+
+  void load(RunId const run, RowCount const record_id) {
+    RowCount const n = std::min(page_size, runs[run].size - record_id);
+    runs[run].dev->eread(records[run * page_size], n * Record_t::bytes,
+                         (runs[run].offset + record_id) * Record_t::bytes);
+    runs[run].page_end = record_id + n;
+    cur[run] = view[run * page_size];
+  }
+
+  void open() {
+    for (RunId run = 0; run < runs.size(); ++run) {
+      load(run, 0);
+    } // for
+  }
+
+  RowCount n_runs() const { return runs.size(); }
+  Record_t const &get(MergeInd const &mind) const {
+    return *reinterpret_cast<Record_t const *>(cur[mind.run_id]);
+  }
+  bool next(MergeInd &mind) {
+    Run const &run = runs[mind.run_id];
+    if (++mind.record_id >= run.size) {
+      return false;
+    }
+    if (mind.record_id == run.page_end) {
+      load(mind.run_id, mind.record_id);
+    } else {
+      cur[mind.run_id] += Record_t::bytes;
+    }
+    return true;
+  }
+}; // struct PagedRunSource
+
+/**
+ * @brief Run source: device-resident runs with double-buffered read-ahead.
+ *
+ * Every run owns two pages of \p page_size records in \p records; page \p p
+ * of a run lives in buffer \p p % 2. Whenever a run moves to its next page,
+ * the runs whose loaded pages end with the smallest keys are forecast to run
+ * dry first and their next pages are read asynchronously into their free
+ * buffers while the merge goes on. Up to \p depth reads are in flight, at most
+ * one per run. Runs hold \p run_size records unless added with their own size.
+ */
+struct PrefetchRunSource {
+  struct Run {
+    Device *dev;
+    RowCount offset; // first record of the run on the device
+    RowCount page;   // page being merged
+    RowCount loaded;   // last page read or being read
+    RowCount size;     // number of records in the run
+    RowCount page_end; // first record past the page being merged
+    std::future<::ssize_t> inflight;
+  };
+
+  RecordArr_t &records;
+  RecordView_t const view; // unchecked records
+  RowCount const page_size;
+  RowCount const run_size;
+  RowCount const depth;
+  std::vector<Run> runs;
+  std::vector<char const *> cur; // current record of each run
+
+  RowCount n_inflight = 0;
+
+  PrefetchRunSource(RecordArr_t &records_, RowCount const page_size_,
+                    RowCount const run_size_, RowCount const depth_ = kIoDepth)
+      : records(records_), view(records_.view()), page_size(page_size_),
+        run_size(run_size_), depth(depth_ > 0 ? depth_ : 1) {}
+  ~PrefetchRunSource() {
+    for (RunId run = 0; run < runs.size(); ++run) {
+      wait(run);
+    } // for
+  }
+
+  void add(Device *dev, RowCount const offset) { add(dev, offset, run_size); }
+  void add(Device *dev, RowCount const offset, RowCount const size) {
+    runs.push_back({dev, offset, 0, 0, size, 0, {}});
+    cur.push_back(nullptr);
+  }
+
+  Record_t &slot(RunId const run, RowCount const page) {
+    return records[(2 * run + page % 2) * page_size];
+  }
+  RowCount page_records(RunId const run, RowCount const page) const {
+    return std::min(page_size, runs[run].size - page * page_size);
+  }
+
+  /**
+   * @brief Merge page \p page of \p run from now on
+   *
+   */
+  void enter(RunId const run, RowCount const page) {
+    runs[run].page = page;
+    runs[run].page_end = page * page_size + page_records(run, page);
+    cur[run] = view[(2 * run + page % 2) * page_size];
+  }
+
+  void wait(RunId const run) {
+    if (runs[run].inflight.valid()) {
+      runs[run].inflight.get();
+      --n_inflight;
+    }
+  }
+
+  void load(RunId const run, RowCount const page) {
+    runs[run].dev->eread(slot(run, page),
+                         page_records(run, page) * Record_t::bytes,
+                         (runs[run].offset + page * page_size) *
+                             Record_t::bytes);
+    runs[run].loaded = page;
+  }
+
+  void prefetch(RunId const run, RowCount const page) {
+    runs[run].inflight = runs[run].dev->async_eread(
+        slot(run, page), page_records(run, page) * Record_t::bytes,
+        (runs[run].offset + page * page_size) * Record_t::bytes);
+    runs[run].loaded = page;
+    ++n_inflight;
+  }
+
+  void forecast() {
+    for (RunId run = 0; run < runs.size() && n_inflight > 0; ++run) {
+      if (runs[run].inflight.valid() &&
+          runs[run].inflight.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready) {
+        wait(run);
+      }
+    } // for
+
+    while (n_inflight < depth) {
+      RunId best = runs.size();
+      Record_t const *best_tail = nullptr;
+      for (RunId run = 0; run < runs.size(); ++run) {
+        RowCount const page = runs[run].page;
+        if (runs[run].loaded != page ||
+            (page + 1) * page_size >= runs[run].size) {
+          continue; // next page already requested or none left
+        }
+        Record_t const &tail = records[(2 * run + page % 2) * page_size +
+                                       page_records(run, page) - 1];
+        if (best_tail == nullptr || tail < *best_tail) {
+          best = run;
+          best_tail = &tail;
+        }
+      } // for
+      if (best == runs.size()) {
+        return;
+      }
+      prefetch(best, runs[best].page + 1);
+    } // while
+  }
+
+  void open() {
+    for (RunId run = 0; run < runs.size(); ++run) {
+      load(run, 0);
+      enter(run, 0);
+    } // for
+    forecast();
+  }
+
+  RowCount n_runs() const { return runs.size(); }
+  Record_t const &get(MergeInd const &mind) const {
+    return *reinterpret_cast<Record_t const *>(cur[mind.run_id]);
+  }
+  bool next(MergeInd &mind) {
+    Run &run = runs[mind.run_id];
+    if (++mind.record_id >= run.size) {
+      return false;
+    }
+    if (mind.record_id < run.page_end) {
+      cur[mind.run_id] += Record_t::bytes;
+      return true;
+    }
+    RowCount const page = run.page + 1;
+    if (run.loaded < page) {
+      load(mind.run_id, page); // forecast missed
+    } else {
+      wait(mind.run_id);
+    }
+    enter(mind.run_id, page);
+    forecast();
+    return true;
+  }
+}; // struct PrefetchRunSource
+
+/**
+ * @brief Output sink: buffer records and write full buffers to a device.
+ *
+ * The output buffer is split into a ring of \p n_bufs buffers. A full buffer
+ * is handed to a background write at its own device offset while the merge
+ * fills the next one; a buffer is only refilled once its write is done.
+ *
+ * An output sink takes the merged records:
+ *   void push(Record_t const &rec);
+ *   Record_t const &last() const; // copy of the last pushed record
+ *   void commit();                 // once per record, after the tree update
+ *   void finish();
+ */
+struct DeviceSink {
+  OutBuffer out;
+  RecordView_t const view; // unchecked output buffer for push()
+  Device *const hd;
+  RowCount const n_bufs;
+  RowCount const buf_size;
+  std::vector<std::future<::ssize_t>> pending; // write of each buffer
+
+  RowCount buf = 0;        // buffer being filled
+  std::size_t out_ind = 0; // next record in the buffer
+  std::size_t const base;  // device offset of the first buffer in bytes
+  std::size_t written = 0; // bytes handed to the device
+
+  DeviceSink(OutBuffer out_, Device *hd_)
+      : DeviceSink(out_, hd_, hd_->get_pos() - hd_->get_base()) {}
+  /**
+   * @brief Write the merged records from device offset \p base_ in bytes
+   *
+   */
+  DeviceSink(OutBuffer out_, Device *hd_, std::size_t const base_)
+      : out(out_), view(out_.out.view()), hd(hd_),
+        n_bufs(out_.out_size >= out_.n_bufs ? out_.n_bufs : 1),
+        buf_size(out_.out_size / n_bufs), pending(n_bufs), base(base_) {}
+  ~DeviceSink() { wait(); }
+
+  void push(Record_t const &rec) { view[buf * buf_size + out_ind++] = rec; }
+  Record_t const &last() const { return view[buf * buf_size + out_ind - 1]; }
+  void flush() {
+    // TODO: check return value
+    pending[buf] = hd->async_ewrite(out.out[buf * buf_size],
+                                    out_ind * Record_t::bytes, base + written);
+    written += out_ind * Record_t::bytes;
+    out_ind = 0;
+    buf = (buf + 1) % n_bufs;
+    if (pending[buf].valid()) {
+      pending[buf].get();
+    }
+  }
+  void commit() {
+    if (out_ind == buf_size) {
+      flush();
+    } // if
+  }
+  void wait() {
+    for (auto &write : pending) {
+      if (write.valid()) {
+        write.get();
+      }
+    } // for
+  }
+  void finish() {
+    if (out_ind > 0) {
+      flush();
+    } // if
+    wait();
+  }
+}; // struct DeviceSink
+
+/**
+ * @brief Append a duplicate record and its count to \p dup_out
+ *
+ */
+inline void dup_append(WriteDevice *dup_out, Record_t &rec,
+                       RowCount const count) {
+  dup_out->append_only(rec, Record_t::bytes);
+  dup_out->append_only(reinterpret_cast<char const *>(&count), sizeof(count));
+} // dup_append
+
+/**
+ * @brief k-way merge of the runs of \p source into \p sink
+ *
+ * Padding runs and filled records end a run. With \p dup_out set, repeated
+ * records are dropped and recorded with their count in \p dup_out.
+ *
+ * @return RowCount number of records pushed to \p sink
+ */
+template <class Source, class Sink>
+RowCount kway_merge(Source &source, Sink &sink, Index_r &index,
+                    WriteDevice *dup_out) {
+  std::unique_ptr<Record_t> prev_record;
+  if (dup_out != nullptr) {
+    prev_record.reset(new Record_t);
+    prev_record->fill();
+  }
+  Record_t *const prev = prev_record.get();
+
+  RowCount const n_runs = source.n_runs();
+
+  Level level(ceil(log2(n_runs)));
+  uint64_t capacity = 1 << level;
+  auto end = index.begin() + capacity;
+  if (end > index.end()) {
+    throw std::out_of_range("kway_merge: index out of range");
+  } // if
+
+  auto get_record = [&source](MergeInd const &mind) -> Record_t const & {
+    return source.get(mind);
+  };
+  auto cmp = ovc_cmp(get_record, n_runs);
+
+  LoserTree ltree(level, cmp, index);
+  for (uint32_t i = 0; i < capacity; ++i) {
+    ltree.insert(i, 0, i < n_runs ? ovc_encode(get_record({i, 0, 0})) : 0);
+  }
+
+  RowCount total = 0;
+  RowCount dupRecordCount = 0;
+
+  while (!ltree.empty()) {
+    MergeInd popped = ltree.pop();
+    if (popped.run_id >= n_runs || get_record(popped).isfilled()) {
+      ltree.deleteRecordId(popped.run_id);
+      continue;
+    }
+    Record_t const &rec = get_record(popped);
+
+    if (prev != nullptr) {
+      // the winner is coded against the record popped before it, a copy of
+      // *prev: code 0 is a duplicate, no need to compare the records again
+      if (total == 0 || popped.ovc != 0) {
+        if (dupRecordCount > 0) {
+          dup_append(dup_out, *prev, dupRecordCount);
+          dupRecordCount = 0;
+        }
+        *prev = rec;
+        sink.push(rec);
+        ++total;
+      } else {
+        ++dupRecordCount;
+      }
+    } else {
+      sink.push(rec);
+      ++total;
+    }
+
+    // the winner's page may be reloaded below, code against its copy
+    Record_t const &last = prev != nullptr ? *prev : sink.last();
+
+    if (source.next(popped)) {
+      ltree.insert(popped.run_id, popped.record_id,
+                   ovc_encode(get_record(popped), last));
+    } else {
+      ltree.deleteRecordId(popped.run_id);
+    }
+
+    sink.commit();
+  }
+
+  if (dupRecordCount > 0) {
+    dup_append(dup_out, *prev, dupRecordCount);
+  }
+  if (dup_out != nullptr) {
+    dup_out->flush();
+  }
+
+  sink.finish();
+  return total;
+} // kway_merge
@@ -0,0 +1,287 @@
+#include "MergePlanner.h"
+#include "Consts.h"
+#include "defs.h"
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <queue>
+#include <spdlog/spdlog.h>
+
+/**
+ * @brief Most runs a merge of \p index_size tree nodes and \p mem_records
+ * records of pages takes, two pages of at least \p page_records per run
+ *
+ */
+static RowCount fan_in_limit(RowCount const index_size,
+                             RowCount const mem_records,
+                             RowCount const page_records) {
+  RowCount limit = 2;
+  while (limit * 2 <= index_size) {
+    limit *= 2; // the tree has a power of two leaves
+  } // while
+  RowCount const page = std::max<RowCount>(1, page_records);
+  return std::max<RowCount>(2,
+                            std::min<RowCount>(limit, mem_records / page / 2));
+} // fan_in_limit
+
+MergePlanner::MergePlanner(RowCount const mem_records,
+                           RowCount const out_records,
+                           RowCount const index_size, Device const *hd_tmp,
+                           Device const *hd_out, RowCount const page_records)
+    : _mem_records(mem_records), _out_records(out_records),
+      _page_records(page_records),
+      _max_fan_in(fan_in_limit(index_size, mem_records, page_records)),
+      _hd_tmp(hd_tmp), _hd_out(hd_out) {}
+
+std::vector<MergePlan>
+MergePlanner::candidates(std::vector<RunDesc> const &runs) const {
+  std::vector<MergePlan> plans;
+  std::size_t const n_runs = runs.size();
+  if (n_runs == 0) {
+    return plans;
+  }
+  if (n_runs <= _max_fan_in) {
+    plans.push_back(balanced(n_runs, std::max<RowCount>(2, n_runs)));
+  }
+  // fan-ins of 2, 3, 4, 6, 8, 12, ... below the number of runs
+  for (RowCount fan_in = 2; fan_in < n_runs && fan_in <= _max_fan_in;
+       fan_in = (fan_in & (fan_in - 1)) == 0 ? fan_in + fan_in / 2
+                                              : fan_in / 3 * 4) {
+    plans.push_back(balanced(n_runs, fan_in));
+    plans.push_back(uneven(runs, fan_in));
+    plans.push_back(polyphase(n_runs, fan_in));
+  } // for
+  for (MergePlan &plan : plans) {
+    evaluate(plan, runs);
+  } // for
+  std::stable_sort(plans.begin(), plans.end(),
+                   [](MergePlan const &a, MergePlan const &b) {
+                     return a.cost < b.cost;
+                   });
+  return plans;
+} // MergePlanner::candidates
+
+MergePlan MergePlanner::plan(std::vector<RunDesc> const &runs) const {
+  std::vector<MergePlan> plans = candidates(runs);
+  for (MergePlan const &plan : plans) {
+    spdlog::debug("PLAN -> {} tree of fan-in {}: {} merges, {} passes, "
+                  "{:.2f} volume, {:.0f} ms",
+                  plan.shape, plan.fan_in, plan.steps.size(), plan.passes,
+                  plan.volume, plan.cost);
+  } // for
+  if (plans.empty()) {
+    return {"balanced", 0, {}};
+  }
+  MergePlan const &best = plans.front();
+  spdlog::info("STATE -> PLAN_MERGE: {} runs, {} tree of fan-in {} out of {} "
+               "candidates: {} merges in {} passes, {:.2f} records read per "
+               "record, predicted {:.0f} ms",
+               runs.size(), best.shape, best.fan_in, plans.size(),
+               best.steps.size(), best.passes, best.volume, best.cost);
+  return best;
+} // MergePlanner::plan
+
+void MergePlanner::evaluate(MergePlan &plan,
+                            std::vector<RunDesc> const &runs) const {
+  std::vector<RowCount> sizes;
+  std::vector<Device const *> devs;
+  std::vector<RowCount> depth(runs.size(), 0);
+  for (RunDesc const &run : runs) {
+    sizes.push_back(run.size);
+    devs.push_back(run.dev);
+  } // for
+
+  RowCount const total =
+      std::accumulate(sizes.begin(), sizes.end(), RowCount(0));
+  RowCount records = 0;
+  plan.cost = 0;
+  for (std::size_t s = 0; s < plan.steps.size(); ++s) {
+    std::vector<std::size_t> const &inputs = plan.steps[s].inputs;
+    // two pages per run unless they would be shorter than the smallest page
+    RowCount const run_records = _mem_records / inputs.size();
+    bool const prefetch =
+        run_records / 2 > 0 && run_records / 2 >= _page_records;
+    RowCount const page =
+        std::max<RowCount>(1, prefetch ? run_records / 2 : run_records);
+    RowCount size = 0;
+    RowCount level = 0;
+    double read = 0;
+    for (std::size_t const run : inputs) {
+      read += read_cost(devs[run], sizes[run], page);
+      size += sizes[run];
+      level = std::max(level, depth[run]);
+    } // for
+    bool const last = s + 1 == plan.steps.size();
+    double const write = write_cost(last ? _hd_out : _hd_tmp, size);
+    // reads are prefetched kIoDepth at a time, at most one per run, while
+    // the two output buffers are written behind
+    RowCount const overlap =
+        prefetch ? std::min<RowCount>(kIoDepth, inputs.size()) : 1;
+    plan.cost = plan.cost + std::max(read / overlap, write / 2);
+    records += size;
+    sizes.push_back(size);
+    devs.push_back(_hd_tmp);
+    depth.push_back(level + 1);
+  } // for
+  plan.passes = depth.back();
+  plan.volume = total > 0 ? double(records) / total : 0;
+} // MergePlanner::evaluate
+
+/**
+ * @brief Passes over groups of \p fan_in adjacent runs, then one final merge
+ *
+ */
+MergePlan MergePlanner::balanced(std::size_t const n_runs,
+                                 RowCount const fan_in) const {
+  MergePlan plan{"balanced", fan_in, {}};
+  std::vector<std::size_t> runs(n_runs);
+  std::iota(runs.begin(), runs.end(), 0);
+  std::size_t next = n_runs;
+  while (runs.size() > fan_in) {
+    std::vector<std::size_t> merged;
+    for (std::size_t i = 0; i < runs.size(); i += fan_in) {
+      std::size_t const end = std::min<std::size_t>(i + fan_in, runs.size());
+      if (end - i == 1) {
+        merged.push_back(runs[i]);
+        continue;
+      }
+      plan.steps.push_back({{runs.begin() + i, runs.begin() + end}});
+      merged.push_back(next++);
+    } // for
+    runs = std::move(merged);
+  } // while
+  plan.steps.push_back({runs});
+  return plan;
+} // MergePlanner::balanced
+
+/**
+ * @brief Merge the smallest runs first, all steps but the first take
+ * \p fan_in runs
+ *
+ */
+MergePlan MergePlanner::uneven(std::vector<RunDesc> const &runs,
+                               RowCount const fan_in) const {
+  MergePlan plan{"uneven", fan_in, {}};
+  using Entry = std::pair<RowCount, std::size_t>; // size, run
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+  for (std::size_t i = 0; i < runs.size(); ++i) {
+    heap.push({runs[i].size, i});
+  } // for
+
+  std::size_t next = runs.size();
+  RowCount take =
+      runs.size() > fan_in ? (runs.size() - 2) % (fan_in - 1) + 2 : runs.size();
+  while (heap.size() > 1 || plan.steps.empty()) {
+    MergeStep step;
+    RowCount size = 0;
+    for (RowCount i = 0; i < take && !heap.empty(); ++i) {
+      size += heap.top().first;
+      step.inputs.push_back(heap.top().second);
+      heap.pop();
+    } // for
+    plan.steps.push_back(std::move(step));
+    heap.push({size, next++});
+    take = fan_in;
+  } // while
+  return plan;
+} // MergePlanner::uneven
+
+/**
+ * @brief Polyphase merge over \p fan_in input files and one output file
+ *
+ * The runs are dealt in the perfect distribution of the smallest level that
+ * holds them, the missing runs are empty and come first on their file. Every
+ * phase merges one run of each input file onto the output file until an
+ * input file runs out; that file takes the output of the next phase.
+ */
+MergePlan MergePlanner::polyphase(std::size_t const n_runs,
+                                  RowCount const fan_in) const {
+  MergePlan plan{"polyphase", fan_in, {}};
+  std::size_t const kEmpty = std::numeric_limits<std::size_t>::max();
+
+  std::vector<std::size_t> level(fan_in, 0);
+  level[0] = 1;
+  std::size_t total = 1;
+  while (total < n_runs) {
+    std::size_t const first = level[0];
+    for (RowCount i = 0; i + 1 < fan_in; ++i) {
+      level[i] = first + level[i + 1];
+    } // for
+    level[fan_in - 1] = first;
+    total = std::accumulate(level.begin(), level.end(), std::size_t(0));
+  } // while
+
+  // spread the empty runs over the files, then deal the runs
+  std::vector<std::deque<std::size_t>> files(fan_in + 1);
+  std::vector<std::size_t> empty(fan_in, 0);
+  for (std::size_t n_empty = total - n_runs, i = 0; n_empty > 0;
+       i = (i + 1) % fan_in) {
+    if (empty[i] < level[i]) {
+      ++empty[i];
+      --n_empty;
+    }
+  } // for
+  std::size_t run = 0;
+  for (RowCount i = 0; i < fan_in; ++i) {
+    files[i].assign(empty[i], kEmpty);
+    for (std::size_t j = empty[i]; j < level[i]; ++j) {
+      files[i].push_back(run++);
+    } // for
+  } // for
+
+  std::size_t next = n_runs;
+  std::size_t out = fan_in;
+  while (total > 1) {
+    std::size_t phase = total;
+    for (std::size_t f = 0; f < files.size(); ++f) {
+      if (f != out) {
+        phase = std::min(phase, files[f].size());
+      }
+    } // for
+    for (std::size_t i = 0; i < phase; ++i) {
+      MergeStep step;
+      for (std::size_t f = 0; f < files.size(); ++f) {
+        if (f == out) {
+          continue;
+        }
+        if (files[f].front() != kEmpty) {
+          step.inputs.push_back(files[f].front());
+        }
+        files[f].pop_front();
+      } // for
+      if (step.inputs.size() > 1) {
+        plan.steps.push_back(std::move(step));
+        files[out].push_back(next++);
+      } else {
+        files[out].push_back(step.inputs.empty() ? kEmpty : step.inputs[0]);
+      }
+      total -= fan_in - 1;
+    } // for
+    for (std::size_t f = 0; f < files.size(); ++f) {
+      if (f != out && files[f].empty()) {
+        out = f;
+        break;
+      }
+    } // for
+  } // while
+  if (plan.steps.empty()) {
+    plan.steps.push_back({{0}}); // a single run is copied
+  }
+  return plan;
+} // MergePlanner::polyphase
+
+double MergePlanner::read_cost(Device const *dev, RowCount const size,
+                               RowCount const page) const {
+  RowCount const n_pages = (size + page - 1) / page;
+  return n_pages * dev->latency() +
+         double(size) * Record_t::bytes / dev->bandwidth();
+} // MergePlanner::read_cost
+
+double MergePlanner::write_cost(Device const *dev, RowCount const size) const {
+  RowCount const buf = std::max<RowCount>(1, _out_records / 2);
+  RowCount const n_bufs = (size + buf - 1) / buf;
+  return n_bufs * dev->latency() +
+         double(size) * Record_t::bytes / dev->bandwidth();
+} // MergePlanner::write_cost
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "Device.h"
+#include "SortFunc.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * @brief One merge of a plan
+ *
+ * Runs are numbered in the order they come to be: the runs to merge first,
+ * then the output of every step.
+ */
+struct MergeStep {
+  std::vector<std::size_t> inputs;
+};
+
+/**
+ * @brief Merge tree of a set of runs and its modeled I/O time
+ *
+ */
+struct MergePlan {
+  std::string shape;             //!< balanced, uneven or polyphase
+  RowCount fan_in;               //!< most runs merged by a step
+  std::vector<MergeStep> steps;  //!< in order, the last one makes the output
+  RowCount passes = 0;           //!< steps on the longest path of the tree
+  double volume = 0;             //!< records read per record to merge
+  double cost = 0;               //!< predicted milliseconds
+};
+
+/**
+ * @brief Cost-based choice of the merge tree of device runs.
+ *
+ * A step merging k runs reads them in pages of memory / 2k records, two pages
+ * per run, and writes its output in halves of the output buffer. The fan-in
+ * is capped so that these pages hold the smallest page; a step whose two
+ * pages would still be shorter reads one page of memory / k at a time. Each
+ * page costs the latency of its device plus its transfer at the device
+ * bandwidth.
+ * Up to kIoDepth page reads are in flight, the writes overlap with them.
+ * Steps write to the temporary device, the last one to the output device.
+ *
+ * For every fan-in up to the index capacity three trees are costed: balanced
+ * passes over groups of adjacent runs, the uneven tree that merges the
+ * smallest runs first (Huffman), and the polyphase tree of a perfect
+ * Fibonacci distribution over fan-in files padded with empty runs.
+ */
+class MergePlanner {
+public:
+  /**
+   * @brief Construct a new MergePlanner object
+   *
+   * @param mem_records memory for the input pages of a step
+   * @param out_records output buffer of a step
+   * @param index_size nodes of the merge index
+   * @param hd_tmp device of the intermediate runs
+   * @param hd_out device of the merged output
+   * @param page_records smallest page worth a device access
+   */
+  MergePlanner(RowCount const mem_records, RowCount const out_records,
+               RowCount const index_size, Device const *hd_tmp,
+               Device const *hd_out, RowCount const page_records = 1);
+
+  /**
+   * @brief Costed merge trees of \p runs, cheapest first
+   *
+   */
+  std::vector<MergePlan> candidates(std::vector<RunDesc> const &runs) const;
+
+  /**
+   * @brief Cheapest merge tree of \p runs, logged with its predicted cost
+   *
+   */
+  MergePlan plan(std::vector<RunDesc> const &runs) const;
+
+  /**
+   * @brief Set the passes, volume and cost of \p plan over \p runs
+   *
+   */
+  void evaluate(MergePlan &plan, std::vector<RunDesc> const &runs) const;
+
+private:
+  MergePlan balanced(std::size_t const n_runs, RowCount const fan_in) const;
+  MergePlan uneven(std::vector<RunDesc> const &runs,
+                   RowCount const fan_in) const;
+  MergePlan polyphase(std::size_t const n_runs, RowCount const fan_in) const;
+
+  double read_cost(Device const *dev, RowCount const size,
+                   RowCount const page) const;
+  double write_cost(Device const *dev, RowCount const size) const;
+
+  RowCount const _mem_records;
+  RowCount const _out_records;
+  RowCount const _page_records;
+  RowCount const _max_fan_in;
+  Device const *const _hd_tmp;
+  Device const *const _hd_out;
+}; // class MergePlanner
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -11,6 +12,7 @@
 #include <new>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <utility>
 
 /**
@@ -27,7 +29,7 @@ template <class Key = unsigned char> struct Record {
   Key key[1];
 
   inline bool operator<(Record const &rhs) const {
-    if (typeid(Key) == typeid(unsigned char)) {
+    if constexpr (std::is_same_v<Key, unsigned char>) {
       return std::memcmp(key, rhs.key, bytes) < 0;
     }
 
@@ -40,7 +42,7 @@ template <class Key = unsigned char> struct Record {
     return false;
   }
   inline bool operator>(Record const &rhs) const {
-    if (typeid(Key) == typeid(unsigned char)) {
+    if constexpr (std::is_same_v<Key, unsigned char>) {
       return std::memcmp(key, rhs.key, bytes) > 0;
     }
 
@@ -53,7 +55,7 @@ template <class Key = unsigned char> struct Record {
     return false;
   }
   inline bool operator==(Record const &rhs) const {
-    if (typeid(Key) == typeid(unsigned char)) {
+    if constexpr (std::is_same_v<Key, unsigned char>) {
       return std::memcmp(key, rhs.key, bytes) == 0;
     }
 
@@ -139,6 +141,125 @@ template <class Key = unsigned char> struct Record {
  */
 using Record_t = Record<>;
 
+/**
+ * @brief Random-access iterator over Records laid out \p stride bytes apart.
+ *
+ * The stride is taken from Record::bytes when the iterator is made and kept
+ * in the iterator, so stepping does not reload the static through stores
+ * that may alias it. Dereferencing gives the Record in place; the Record
+ * type is a view of its first key, so algorithms that copy values out of a
+ * range (std::sort, std::rotate) would slice them. Use the iterators with
+ * algorithms that only compare and look up, such as std::is_sorted and
+ * std::lower_bound, and reorder through an Index.
+ */
+template <class Key = unsigned char> struct RecordIterator {
+  using iterator_category = std::random_access_iterator_tag;
+  using difference_type = std::ptrdiff_t;
+  using value_type = Record<Key>;
+  using pointer = Record<Key> *;
+  using reference = Record<Key> &;
+
+  RecordIterator() = default;
+  RecordIterator(pointer ptr_, std::size_t const stride_ = Record<Key>::bytes)
+      : ptr(reinterpret_cast<char *>(ptr_)), stride(stride_) {}
+
+  reference operator*() const { return *reinterpret_cast<pointer>(ptr); }
+  pointer operator->() const { return reinterpret_cast<pointer>(ptr); }
+  reference operator[](difference_type const n) const { return *(*this + n); }
+  RecordIterator &operator++() {
+    ptr += stride;
+    return *this;
+  }
+  RecordIterator operator++(int) {
+    RecordIterator tmp = *this;
+    ++*this;
+    return tmp;
+  }
+  RecordIterator &operator--() {
+    ptr -= stride;
+    return *this;
+  }
+  RecordIterator operator--(int) {
+    RecordIterator tmp = *this;
+    --*this;
+    return tmp;
+  }
+  RecordIterator &operator+=(difference_type const n) {
+    ptr += n * static_cast<difference_type>(stride);
+    return *this;
+  }
+  RecordIterator operator+(difference_type const n) const {
+    RecordIterator tmp = *this;
+    return tmp += n;
+  }
+  friend RecordIterator operator+(difference_type const n,
+                                  RecordIterator const &it) {
+    return it + n;
+  }
+  RecordIterator &operator-=(difference_type const n) {
+    ptr -= n * static_cast<difference_type>(stride);
+    return *this;
+  }
+  RecordIterator operator-(difference_type const n) const {
+    RecordIterator tmp = *this;
+    return tmp -= n;
+  }
+  difference_type operator-(RecordIterator const &rhs) const {
+    return (ptr - rhs.ptr) / static_cast<difference_type>(stride);
+  }
+  bool operator==(RecordIterator const &rhs) const { return ptr == rhs.ptr; }
+  bool operator!=(RecordIterator const &rhs) const { return ptr != rhs.ptr; }
+  bool operator<(RecordIterator const &rhs) const { return ptr < rhs.ptr; }
+  bool operator>(RecordIterator const &rhs) const { return ptr > rhs.ptr; }
+  bool operator<=(RecordIterator const &rhs) const { return ptr <= rhs.ptr; }
+  bool operator>=(RecordIterator const &rhs) const { return ptr >= rhs.ptr; }
+
+private:
+  char *ptr = nullptr;
+  std::size_t stride = 0;
+}; // struct RecordIterator
+
+/**
+ * @brief Unchecked view of a Record Array for the inner loops.
+ *
+ * A raw base pointer and the stride, without the shared ownership and the
+ * range check of RecordArr. Indexing is only checked in _DEBUG builds. The
+ * view does not keep the array alive, the RecordArr it was taken from must.
+ */
+template <class Key = unsigned char> struct RecordView {
+  using Iterator = RecordIterator<Key>;
+
+  RecordView() = default;
+  RecordView(Record<Key> *base_, std::size_t const size_,
+             std::size_t const stride_ = Record<Key>::bytes)
+      : base(reinterpret_cast<char *>(base_)), sz(size_), stride(stride_) {}
+
+  Record<Key> &operator[](std::size_t const idx) const {
+#ifdef _DEBUG
+    if (idx >= sz)
+      throw std::out_of_range("RecordView index " + std::to_string(idx) +
+                              " out of range " + std::to_string(sz));
+#endif // _DEBUG
+    return *reinterpret_cast<Record<Key> *>(base + idx * stride);
+  }
+  Iterator begin() const {
+    return Iterator(reinterpret_cast<Record<Key> *>(base), stride);
+  }
+  Iterator end() const { return begin() + sz; }
+  std::size_t size() const { return sz; }
+
+private:
+  char *base = nullptr;
+  std::size_t sz = 0;
+  std::size_t stride = 0;
+}; // struct RecordView
+
+/**
+ * @brief Default RecordView type.
+ *
+ */
+using RecordView_t = RecordView<>;
+
 /**
  * @brief A RecordArr is a wrapper for Record Array.
  *
@@ -153,6 +274,8 @@ private:
   const std::size_t sz = 0;
 
 public:
+  using Iterator = RecordIterator<Key>;
+
   RecordArr() = default;
   RecordArr(std::size_t const size) : arr(new Record<Key>[size]), sz(size) {}
   RecordArr(shared_arr const &arr_, std::size_t const size)
@@ -174,6 +297,13 @@ public:
         reinterpret_cast<char *>(arr.get()) + idx * Record<Key>::bytes);
   }
   Record<Key> *data() const { return arr.get(); }
+  Iterator begin() const { return Iterator(arr.get()); }
+  Iterator end() const { return begin() + sz; }
+  /**
+   * @brief Unchecked view of the records, checked in _DEBUG builds
+   *
+   */
+  RecordView<Key> view() const { return RecordView<Key>(arr.get(), sz); }
   shared_arr ptr() const { return arr; }
   shared_arr ptr(std::size_t offset_byte) const {
     char *offset_ptr = reinterpret_cast<char *>(arr.get()) + offset_byte;
@@ -279,7 +409,8 @@ public:
   };
 
   Index() = default;
-  Index(std::size_t const size) : arr(new Ind[size]), sz(size) {}
+  Index(std::size_t const size)
+      : arr(new Ind[size], std::default_delete<Ind[]>()), sz(size) {}
   Index(shared_arr const &arr_, std::size_t const size) : arr(arr_), sz(size) {}
   ~Index() = default;
 
@@ -296,14 +427,66 @@ public:
   Iterator begin() { return Iterator(arr.get()); }
   Iterator end() { return Iterator(arr.get() + sz); }
   Ind *data() { return arr.get(); }
+  Ind const *data() const { return arr.get(); }
+  shared_arr ptr() const { return arr; }
   std::size_t size() const { return sz; }
 };
 
 using Index_t = Index<>;
 
+/**
+ * @brief Wide index for runs of more than UINT16_MAX records.
+ *
+ */
+using Index_w = Index<uint32_t>;
+
+/**
+ * @brief Sort index of a cache run, as wide as the run needs.
+ *
+ * Entries are uint16_t while a cache run has at most UINT16_MAX records and
+ * uint32_t beyond, so small records in a large cache make long runs without
+ * doubling the index of the common case. \p mem holds \p size entries of
+ * \p width bytes.
+ */
+struct CacheIndex {
+  std::shared_ptr<Record<>> mem;
+  std::size_t size;
+  std::size_t width; // sizeof(uint16_t) or sizeof(uint32_t)
+
+  CacheIndex(std::shared_ptr<Record<>> const &mem_, std::size_t const size_,
+             std::size_t const width_)
+      : mem(mem_), size(size_), width(width_) {}
+  template <class Ind>
+  CacheIndex(Index<Ind> const &index)
+      : mem(index.ptr(), reinterpret_cast<Record<> *>(index.ptr().get())),
+        size(index.size()), width(sizeof(Ind)) {
+    static_assert(sizeof(Ind) == sizeof(uint16_t) ||
+                  sizeof(Ind) == sizeof(uint32_t));
+  }
+
+  template <class Ind> Index<Ind> as() const {
+    return Index<Ind>(
+        std::shared_ptr<Ind>(mem, reinterpret_cast<Ind *>(mem.get())), size);
+  }
+
+  /**
+   * @brief Call \p fn with the Index of the entry width
+   *
+   */
+  template <typename Fn> decltype(auto) visit(Fn &&fn) const {
+    if (width == sizeof(uint32_t)) {
+      Index_w index = as<uint32_t>();
+      return fn(index);
+    }
+    Index_t index = as<uint16_t>();
+    return fn(index);
+  }
+}; // struct CacheIndex
+
 struct MergeInd {
   uint32_t run_id;
   uint32_t record_id;
+  uint32_t ovc; // offset-value code against the last merge output
   inline bool operator<(MergeInd const &rhs) const {
     return run_id < rhs.run_id ||
            (run_id == rhs.run_id && record_id < rhs.record_id);
@@ -311,3 +494,16 @@ struct MergeInd {
 };
 
 using Index_r = Index<MergeInd>;
+
+/**
+ * @brief Normalized key prefix of a cache-resident Record.
+ *
+ * The leading bytes of the key packed big-endian, so integer order on \p prefix
+ * is the byte order of the records.
+ */
+struct PrefixInd {
+  uint64_t prefix;
+  uint32_t record_id; // fits the padding after prefix: 16 bytes, as uint16_t
+};
+
+using Index_p = Index<PrefixInd>;
@@ -0,0 +1,368 @@
+#include "RunGen.h"
+#include "Consts.h"
+#include "Utils.h"
+#include "defs.h"
+#include <spdlog/spdlog.h>
+
+RunWriter::RunWriter(OutBuffer out, Device *ssd, Device *hdd)
+    : _out(out), _ssd(ssd), _hdd(hdd), _ssd_full(false), _dev(nullptr),
+      _run_offset(0), _run_records(0), _n_runs(0), _written(0) {}
+
+void RunWriter::begin() {
+  close();
+  ++_n_runs;
+  open(_ssd_full ? _hdd : _ssd);
+} // RunWriter::begin
+
+void RunWriter::push(Record_t const &rec) {
+  // the device position lags behind the writes in flight, count ourselves
+  if (_dev == _ssd && _run_records % _sink->buf_size == 0 &&
+      !fits(_run_offset + _run_records, _sink->buf_size)) {
+    // the SSD is full, the run goes on on the HDD
+    _ssd_full = true;
+    close();
+    open(_hdd);
+  }
+  _sink->push(rec);
+  ++_run_records;
+  ++_written;
+  _sink->commit();
+} // RunWriter::push
+
+void RunWriter::end() { close(); } // RunWriter::end
+
+Device *RunWriter::append(RowCount const size) {
+  close();
+  if (!_ssd_full &&
+      !fits((_ssd->get_pos() - _ssd->get_base()) / Record_t::bytes, size)) {
+    _ssd_full = true;
+  }
+  Device *const dev = _ssd_full ? _hdd : _ssd;
+  _runs.push_back(
+      {dev, (dev->get_pos() - dev->get_base()) / Record_t::bytes, size});
+  ++_n_runs;
+  _written += size;
+  return dev;
+} // RunWriter::append
+
+std::vector<RunDesc> RunWriter::take() {
+  close();
+  return std::move(_runs);
+} // RunWriter::take
+
+/**
+ * @brief The SSD has room for \p size more records from record \p end
+ *
+ */
+bool RunWriter::fits(RowCount const end, RowCount const size) const {
+  return (end + size) * Record_t::bytes + _ssd->get_base() <=
+         _ssd->capacity();
+} // RunWriter::fits
+
+void RunWriter::open(Device *dev) {
+  _dev = dev;
+  _sink = std::make_unique<DeviceSink>(_out, dev);
+  _run_offset = (dev->get_pos() - dev->get_base()) / Record_t::bytes;
+  _run_records = 0;
+} // RunWriter::open
+
+void RunWriter::close() {
+  if (_sink == nullptr) {
+    return;
+  }
+  _sink->finish();
+  _sink.reset();
+  if (_run_records > 0) {
+    _runs.push_back({_dev, _run_offset, _run_records});
+  }
+} // RunWriter::close
+
+/**
+ * @brief Height of the largest tree whose slots and index fit in \p work
+ *
+ */
+Level ReplacementSelection::height(RecordArr_t const &work) {
+  std::size_t const bytes = work.size() * Record_t::bytes;
+  Level h = 0;
+  while ((std::size_t(2) << h) * (Record_t::bytes + sizeof(MergeInd)) <=
+         bytes) {
+    ++h;
+  } // while
+  // a taller tree pays off if its index leaves room for more slots
+  std::size_t const taller = (std::size_t(2) << h) * sizeof(MergeInd);
+  if (taller < bytes && (bytes - taller) / Record_t::bytes > (1u << h)) {
+    ++h;
+  }
+  return h;
+} // ReplacementSelection::height
+
+RowCount ReplacementSelection::n_slots(RecordArr_t const &work,
+                                       Level const h) {
+  std::size_t const bytes = work.size() * Record_t::bytes;
+  std::size_t const index = (std::size_t(1) << h) * sizeof(MergeInd);
+  return std::min<RowCount>(std::size_t(1) << h,
+                            (bytes - index) / Record_t::bytes);
+} // ReplacementSelection::n_slots
+
+ReplacementSelection::ReplacementSelection(RecordArr_t const &work,
+                                           OutBuffer out, Device *ssd,
+                                           Device *hdd)
+    : _height(height(work)), _n_slots(n_slots(work, _height)),
+      _slots(work.ptr(), _n_slots),
+      _index(ptr_cast<Record_t, MergeInd>(work.ptr(
+                 (_n_slots * Record_t::bytes + 15) / 16 * 16)),
+             std::size_t(1) << _height),
+      _tree(_height, GenerationLess{_slots.view()}, _index), _filled(0),
+      _writer(out, ssd, hdd), _run(0) {
+  TRACE(true);
+  spdlog::info("STATE -> GENERATE_RUNS: Replacement selection over {} slots",
+               _n_slots);
+} // ReplacementSelection::ReplacementSelection
+
+void ReplacementSelection::push(Record_t const &rec) {
+  if (_filled < _n_slots) {
+    _slots[_filled] = rec;
+    _tree.insert(_filled, 0);
+    if (++_filled == _n_slots) {
+      fence(_n_slots);
+    }
+    return;
+  }
+
+  MergeInd const winner = _tree.pop();
+  output(winner.run_id, winner.record_id);
+  // a record smaller than the one just written waits for the next run
+  uint32_t const run =
+      rec < _slots[winner.run_id] ? winner.record_id + 1 : winner.record_id;
+  _slots[winner.run_id] = rec;
+  _tree.insert(winner.run_id, run);
+} // ReplacementSelection::push
+
+std::vector<RunDesc> ReplacementSelection::finish() {
+  if (_filled < _n_slots) {
+    fence(_filled);
+  }
+  while (!_tree.empty()) {
+    MergeInd const winner = _tree.pop();
+    output(winner.run_id, winner.record_id);
+    _tree.deleteRecordId(winner.run_id);
+  } // while
+
+  RowCount const n_runs = _writer.n_runs();
+  spdlog::info("STATE -> GENERATE_RUNS: {} runs of {} records on average",
+               n_runs, n_runs > 0 ? _writer.written() / n_runs : 0);
+  return _writer.take();
+} // ReplacementSelection::finish
+
+void ReplacementSelection::output(RunId const slot, uint32_t const run) {
+  if (_writer.n_runs() == 0 || run != _run) {
+    _writer.begin();
+    _run = run;
+  }
+  _writer.push(_slots[slot]);
+} // ReplacementSelection::output
+
+/**
+ * @brief Close the leaves from \p first on, so the tree has a valid root
+ *
+ */
+void ReplacementSelection::fence(RunId const first) {
+  for (RunId i = first; i < _tree.capacity(); ++i) {
+    _tree.deleteRecordId(i);
+  } // for
+} // ReplacementSelection::fence
+
+/**
+ * @brief Byte offset of the merge index after \p n_records records
+ *
+ */
+static std::size_t merge_index_offset(RowCount const n_records) {
+  return (n_records * Record_t::bytes + 15) / 16 * 16;
+} // merge_index_offset
+
+/**
+ * @brief Entries of the index merging \p n_runs runs, a power of two
+ *
+ */
+static std::size_t merge_index_size(RowCount const n_runs) {
+  std::size_t size = 1;
+  while (size < n_runs) {
+    size *= 2;
+  } // while
+  return size;
+} // merge_index_size
+
+/**
+ * @brief Records of a cache run, shortened if one run and its merge index
+ * do not fit in \p work
+ *
+ */
+RowCount NaturalRuns::cache_run(RecordArr_t const &work) {
+  std::size_t const bytes = work.size() * Record_t::bytes;
+  std::size_t const index = merge_index_size(1) * sizeof(MergeInd);
+  RowCount const run = std::min<RowCount>(cache_nrecords(), work.size());
+  if (merge_index_offset(run) + index <= bytes) {
+    return run;
+  }
+  return (bytes - index - 15) / Record_t::bytes;
+} // NaturalRuns::cache_run
+
+/**
+ * @brief Cache runs of \p work that leave room for the index merging them
+ *
+ */
+RowCount NaturalRuns::n_runs(RecordArr_t const &work,
+                             RowCount const cache_run) {
+  std::size_t const bytes = work.size() * Record_t::bytes;
+  RowCount n = work.size() / cache_run;
+  while (n > 1 && merge_index_offset(n * cache_run) +
+                          merge_index_size(n) * sizeof(MergeInd) >
+                      bytes) {
+    --n;
+  } // while
+  return n;
+} // NaturalRuns::n_runs
+
+NaturalRuns::NaturalRuns(RecordArr_t const &work, CacheIndex const &index,
+                         OutBuffer out, Device *ssd, Device *hdd,
+                         Device *hd_out)
+    : _cache_run(cache_run(work)),
+      _work(work.ptr(), n_runs(work, _cache_run) * _cache_run), _index(index),
+      _merge_index(ptr_cast<Record_t, MergeInd>(
+                       work.ptr(merge_index_offset(_work.size()))),
+                   merge_index_size(_work.size() / _cache_run)),
+      _out(out), _hd_out(hd_out), _filled(0),
+      _ascending(true), _descending(true), _streaming(false), _in_out(0),
+      _writer(out, ssd, hdd) {
+  TRACE(true);
+  spdlog::info("STATE -> GENERATE_RUNS: Natural runs of at least {} records",
+               _work.size());
+} // NaturalRuns::NaturalRuns
+
+void NaturalRuns::push(Record_t const &rec) {
+  if (_streaming) {
+    if (!(rec < _work[0])) {
+      output(rec);
+      _work[0] = rec;
+      return;
+    }
+    end_stream();
+  }
+
+  if (_filled > 0) {
+    bool const less = rec < _work[_filled - 1];
+    _ascending = _ascending && !less;
+    _descending = _descending && less;
+  }
+  _work[_filled++] = rec;
+  if (_filled == _work.size()) {
+    spill();
+  }
+} // NaturalRuns::push
+
+std::vector<RunDesc> NaturalRuns::finish() {
+  if (_filled > 0) {
+    spill();
+  }
+  if (_first != nullptr) {
+    // the input is one ascending run, already in the output device
+    _first->finish();
+    _first.reset();
+    spdlog::info("STATE -> GENERATE_RUNS: Input is sorted, {} records",
+                 _in_out);
+    return {};
+  }
+
+  RowCount const n_runs = _writer.n_runs();
+  spdlog::info("STATE -> GENERATE_RUNS: {} runs of {} records on average",
+               n_runs, n_runs > 0 ? _writer.written() / n_runs : 0);
+  return _writer.take();
+} // NaturalRuns::finish
+
+/**
+ * @brief Write out the collected records as a run
+ *
+ */
+void NaturalRuns::spill() {
+  if (_ascending) {
+    if (_hd_out != nullptr && _writer.n_runs() == 0) {
+      _first = std::make_unique<DeviceSink>(_out, _hd_out);
+    } else {
+      _writer.begin();
+    }
+    for (RowCount i = 0; i < _filled; ++i) {
+      output(_work[i]);
+    } // for
+    _work[0] = _work[_filled - 1];
+    _streaming = true;
+  } else if (_descending) {
+    _writer.begin();
+    for (RowCount i = _filled; i > 0; --i) {
+      _writer.push(_work[i - 1]);
+    } // for
+    _writer.end();
+  } else {
+    sort_spill();
+  }
+  _filled = 0;
+  _ascending = _descending = true;
+} // NaturalRuns::spill
+
+/**
+ * @brief Sort the collected records as cache runs merged into one run
+ *
+ */
+void NaturalRuns::sort_spill() {
+  RowCount const n_runs = (_filled + _cache_run - 1) / _cache_run;
+  for (RowCount i = 0; i < n_runs; ++i) {
+    RecordArr_t run = _work + i * _cache_run;
+    RowCount const n_records = std::min(_cache_run, _filled - i * _cache_run);
+    _index.visit(
+        [&](auto &index) { incache_sort(run, index, n_records); });
+    if (n_records < _cache_run) {
+      run[n_records].fill(); // ends the last cache run
+    }
+  } // for
+  Device *const dev = _writer.append(_filled);
+  inmem_merge(_work, _out, dev, _merge_index, {_cache_run, n_runs}, nullptr,
+              true);
+} // NaturalRuns::sort_spill
+
+void NaturalRuns::output(Record_t const &rec) {
+  if (_first != nullptr) {
+    _first->push(rec);
+    ++_in_out;
+    _first->commit();
+  } else {
+    _writer.push(rec);
+  }
+} // NaturalRuns::output
+
+void NaturalRuns::end_stream() {
+  _streaming = false;
+  if (_first != nullptr) {
+    _first->finish();
+    _first.reset();
+    relocate();
+  } else {
+    _writer.end();
+  }
+} // NaturalRuns::end_stream
+
+/**
+ * @brief Move the first run from the output device to the SSD or HDD
+ *
+ * The work area is free, it carries the copy.
+ */
+void NaturalRuns::relocate() {
+  Device *const dev = _writer.append(_in_out);
+  char *const buffer = reinterpret_cast<char *>(_work.data());
+  for (RowCount offset = 0; offset < _in_out; offset += _work.size()) {
+    std::size_t const bytes =
+        std::min(_work.size(), _in_out - offset) * Record_t::bytes;
+    _hd_out->eread(buffer, bytes, offset * Record_t::bytes);
+    dev->eappend(buffer, bytes);
+  } // for
+  _hd_out->clear();
+  _in_out = 0;
+} // NaturalRuns::relocate
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "Device.h"
+#include "Iterator.h"
+#include "LoserTree.h"
+#include "MergeEngine.h"
+#include "Record.h"
+#include "SortFunc.h"
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Writes generated runs to the SSD while it has room, then to the HDD.
+ *
+ * A run that does not fit on the SSD continues on the HDD as a second run.
+ */
+class RunWriter {
+public:
+  RunWriter(OutBuffer out, Device *ssd, Device *hdd);
+
+  /**
+   * @brief End the current run, if any, and start a new one
+   *
+   */
+  void begin();
+  void push(Record_t const &rec);
+  void end();
+
+  /**
+   * @brief End the current run and add a run of \p size records
+   *
+   * @return Device* device the caller appends the run to
+   */
+  Device *append(RowCount const size);
+
+  RowCount n_runs() const { return _n_runs; }
+  RowCount written() const { return _written; }
+
+  /**
+   * @brief End the current run and hand over the runs
+   *
+   * @return std::vector<RunDesc> the runs in the order they were written
+   */
+  std::vector<RunDesc> take();
+
+private:
+  bool fits(RowCount const end, RowCount const size) const;
+  void open(Device *dev);
+  void close();
+
+  OutBuffer _out;
+  Device *const _ssd;
+  Device *const _hdd;
+  bool _ssd_full;
+
+  std::unique_ptr<DeviceSink> _sink; // current run
+  Device *_dev;
+  RowCount _run_offset, _run_records;
+  RowCount _n_runs; // runs generated, a run split over two devices counts once
+  RowCount _written;
+  std::vector<RunDesc> _runs;
+}; // class RunWriter
+
+/**
+ * @brief Replacement selection run generation.
+ *
+ * A tree of losers over the record slots of the work area orders the slots
+ * by (run, record). The winner is written to the current run and its slot
+ * takes the next input record, which joins the current run if it is not
+ * smaller than the winner and the next run otherwise. On random input runs
+ * average twice the number of slots, presorted input makes a single run.
+ */
+class ReplacementSelection {
+public:
+  /**
+   * @brief Construct a new ReplacementSelection object
+   *
+   * @param work record slots and the tree index, both carved from \p work
+   * @param out output buffer of the runs
+   */
+  ReplacementSelection(RecordArr_t const &work, OutBuffer out, Device *ssd,
+                       Device *hdd);
+
+  /**
+   * @brief Add the next input record
+   *
+   */
+  void push(Record_t const &rec);
+
+  /**
+   * @brief Drain the tree
+   *
+   * @return std::vector<RunDesc> the runs in the order they were written
+   */
+  std::vector<RunDesc> finish();
+
+  RowCount slots() const { return _n_slots; }
+
+private:
+  struct GenerationLess {
+    RecordView_t slots;
+    bool operator()(MergeInd &a, MergeInd &b) const {
+      if (a.record_id != b.record_id) {
+        return a.record_id < b.record_id; // record_id holds the run
+      }
+      return slots[a.run_id] < slots[b.run_id];
+    }
+  }; // struct GenerationLess
+
+  static Level height(RecordArr_t const &work);
+  static RowCount n_slots(RecordArr_t const &work, Level const h);
+
+  void fence(RunId const first);
+  void output(RunId const slot, uint32_t const run);
+
+  Level const _height;
+  RowCount const _n_slots;
+  RecordArr_t _slots;
+  Index_r _index;
+  LoserTree<GenerationLess> _tree;
+  RowCount _filled; // slots holding a record
+
+  RunWriter _writer;
+  uint32_t _run; // run of the records written last
+}; // class ReplacementSelection
+
+/**
+ * @brief Natural run detection for presorted and nearly sorted input.
+ *
+ * Records are collected in the work area. When it fills up with one
+ * ascending run, the run is streamed to a device until a smaller record ends
+ * it; one strictly descending run is written reversed; anything else is
+ * sorted as cache runs merged into one memory-sized run. The first run goes
+ * straight to the output device, so sorted input is a single streaming copy;
+ * it is moved to the SSD or HDD as soon as a second run starts.
+ */
+class NaturalRuns {
+public:
+  /**
+   * @brief Construct a new NaturalRuns object
+   *
+   * @param work collected records and the index merging their cache runs,
+   * both carved from \p work
+   * @param index sorts a cache run of \p work
+   * @param out output buffer of the runs
+   * @param hd_out output device, null to write all runs to \p ssd or \p hdd
+   */
+  NaturalRuns(RecordArr_t const &work, CacheIndex const &index, OutBuffer out,
+              Device *ssd, Device *hdd, Device *hd_out);
+
+  /**
+   * @brief Add the next input record
+   *
+   */
+  void push(Record_t const &rec);
+
+  /**
+   * @brief Write out the collected records
+   *
+   * @return std::vector<RunDesc> the runs to merge, none if the input is
+   * already sorted in the output device
+   */
+  std::vector<RunDesc> finish();
+
+  RowCount capacity() const { return _work.size(); }
+
+private:
+  static RowCount cache_run(RecordArr_t const &work);
+  static RowCount n_runs(RecordArr_t const &work, RowCount const cache_run);
+
+  void spill();
+  void sort_spill();
+  void output(Record_t const &rec);
+  void end_stream();
+  void relocate();
+
+  RowCount const _cache_run;
+  RecordArr_t _work; // whole cache runs
+  CacheIndex _index;
+  Index_r _merge_index; // after _work, apart from the batch being pushed
+  OutBuffer _out;
+  Device *const _hd_out;
+
+  RowCount _filled; // collected records
+  bool _ascending;  // the collected records are one ascending run
+  bool _descending; // the collected records are one strictly descending run
+  bool _streaming;  // an ascending run is written as its records come
+
+  std::unique_ptr<DeviceSink> _first; // first run, into the output device
+  RowCount _in_out;                   // records of the first run
+
+  RunWriter _writer;
+}; // class NaturalRuns
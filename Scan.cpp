@@ -4,14 +4,21 @@
 #include "Iterator.h"
 #include "Record.h"
 #include "Utils.h"
+#include "Witness.h"
 #include "defs.h"
-#include <ctime>
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <spdlog/spdlog.h>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
-ScanPlan::ScanPlan(RowCount const count)
-    : _count(count),
-      _rcache(std::shared_ptr<Record_t>(
-                  reinterpret_cast<Record_t *>(new char[kCacheSize])),
-              fcache_nrecords()),
+ScanPlan::ScanPlan(RowCount const count, std::string const &prefix,
+                   uint64_t const seed)
+    : _count(count), _prefix(prefix), _seed(seed),
+      _rcache(aligned_records(Config::cache_size), fcache_nrecords()),
       _inputWitnessRecord(new Record_t) {
   TRACE(true);
   _inputWitnessRecord->fill(0);
@@ -25,8 +32,18 @@ Iterator *ScanPlan::init() const {
 } // ScanPlan::init
 
 ScanIterator::ScanIterator(ScanPlan const *const plan)
-    : _plan(plan), _count(0), _kRowCache(cache_nrecords()) {
+    : _plan(plan), _count(0), _in(plan->_prefix + kIn, isDirectIo()) {
   TRACE(true);
+  Prng prng(plan->_seed);
+  for (std::size_t s = 0; s < kGenStreams; ++s) {
+    _streams.push_back({prng, nullptr});
+    prng.jump();
+  } // for
+  if (genThreads() > 1) {
+    _pool = std::make_unique<ThreadPool>(genThreads());
+  }
+  spdlog::info("STATE -> GENERATE_INPUT: {} records of seed {}", plan->_count,
+               plan->_seed);
 } // ScanIterator::ScanIterator
 
 ScanIterator::~ScanIterator() {
@@ -35,28 +52,26 @@ ScanIterator::~ScanIterator() {
               (unsigned long)(_plan->_count));
 } // ScanIterator::~ScanIterator
 
-/**
- * @brief Fast Random Generator
- * @ref https://prng.di.unimi.it
- *
- */
-
 static inline uint64_t rotl(const uint64_t x, int k) {
   return (x << k) | (x >> (64 - k));
 }
 
-uint64_t prng_seed() {
-  static uint64_t x = time(NULL);
-
+static uint64_t splitmix64(uint64_t &x) {
   uint64_t z = (x += 0x9e3779b97f4a7c15);
   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
   z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
   return z ^ (z >> 31);
 }
 
-uint64_t prng_rand(void) {
-  static uint64_t s[4] = {prng_seed(), prng_seed(), prng_seed(), prng_seed()};
+Prng::Prng(uint64_t const seed) {
+  uint64_t x = seed;
+  for (uint64_t &s : _s) {
+    s = splitmix64(x);
+  } // for
+} // Prng::Prng
 
+uint64_t Prng::operator()() {
+  uint64_t *const s = _s;
   const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
 
   const uint64_t t = s[1] << 17;
@@ -71,17 +86,72 @@ uint64_t prng_rand(void) {
   s[3] = rotl(s[3], 45);
 
   return result;
-}
+} // Prng::operator()
+
+void Prng::jump() {
+  static const uint64_t JUMP[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                  0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+  uint64_t s[4] = {0, 0, 0, 0};
+  for (uint64_t const jump : JUMP) {
+    for (int b = 0; b < 64; ++b) {
+      if (jump & uint64_t(1) << b) {
+        for (int i = 0; i < 4; ++i) {
+          s[i] ^= _s[i];
+        } // for
+      }
+      (*this)();
+    } // for
+  } // for
+  std::copy(s, s + 4, _s);
+} // Prng::jump
+
+void alnum_bytes_scalar(uint8_t *const bytes, std::size_t const n) {
+  for (std::size_t i = 0; i < n; ++i) {
+    uint8_t x = bytes[i] & 63;
+    x = x > 61 ? x - 62 : x;
+    // '0'..'9', then 7 past '9' 'A'..'Z', then 6 past 'Z' 'a'..'z'
+    bytes[i] = x + '0' + (x > 9 ? 7 : 0) + (x > 35 ? 6 : 0);
+  } // for
+} // alnum_bytes_scalar
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static void
+alnum_bytes_avx2(uint8_t *const bytes, std::size_t const n) {
+  __m256i const low6 = _mm256_set1_epi8(63);
+  __m256i const wrap = _mm256_set1_epi8(61), n_wrap = _mm256_set1_epi8(62);
+  __m256i const digit = _mm256_set1_epi8(9), to_upper = _mm256_set1_epi8(7);
+  __m256i const upper = _mm256_set1_epi8(35), to_lower = _mm256_set1_epi8(6);
+  __m256i const zero = _mm256_set1_epi8('0');
+  std::size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i *const at = reinterpret_cast<__m256i *>(bytes + i);
+    __m256i x = _mm256_and_si256(_mm256_loadu_si256(at), low6);
+    x = _mm256_sub_epi8(
+        x, _mm256_and_si256(_mm256_cmpgt_epi8(x, wrap), n_wrap));
+    __m256i c = _mm256_add_epi8(x, zero);
+    c = _mm256_add_epi8(
+        c, _mm256_and_si256(_mm256_cmpgt_epi8(x, digit), to_upper));
+    c = _mm256_add_epi8(
+        c, _mm256_and_si256(_mm256_cmpgt_epi8(x, upper), to_lower));
+    _mm256_storeu_si256(at, c);
+  } // for
+  alnum_bytes_scalar(bytes + i, n - i);
+} // alnum_bytes_avx2
+#endif
+
+void alnum_bytes(uint8_t *const bytes, std::size_t const n) {
+#if defined(__x86_64__)
+  static bool const avx2 = __builtin_cpu_supports("avx2");
+  if (avx2) {
+    alnum_bytes_avx2(bytes, n);
+    return;
+  }
+#endif
+  alnum_bytes_scalar(bytes, n);
+} // alnum_bytes
 
 union random_t {
   uint64_t i;
-  struct {
-    uint8_t key[6];
-    // 3 bit: larger than 5, use current duplicate
-    // 3 bit: larger than 5, generate new duplicate
-    // every two bits: 01: number, 10: upper case, 11 / 00: lower case
-    uint16_t alpha_num;
-  } s;
   struct {
     int32_t use_dup;
     uint8_t coeff[2];
@@ -89,70 +159,103 @@ union random_t {
   } d;
 };
 
-void gen_record(Record_t &rec) {
-  for (std::size_t i = 0; i < rec.bytes; i += sizeof(random_t::s.key)) {
-    uint8_t range = std::min(sizeof(random_t::s.key), rec.bytes - i);
-    random_t r = {.i = prng_rand()};
-    for (std::size_t j = 0; j < range; ++j) {
-      if ((r.s.alpha_num & 0b11) == 0b01) {
-        rec.key[i + j] = r.s.key[j] % 10 + '0';
-      } else if ((r.s.alpha_num & 0b11) == 0b10) {
-        rec.key[i + j] = r.s.key[j] % 26 + 'A';
-      } else {
-        rec.key[i + j] = r.s.key[j] % 26 + 'a';
-      }
-      r.s.alpha_num >>= 2;
-    }
-  }
-}
+void ScanIterator::gen_record(Prng &prng, Record_t &rec) {
+  for (std::size_t i = 0; i < rec.bytes; i += sizeof(uint64_t)) {
+    uint64_t const r = prng();
+    std::memcpy(rec.key + i, &r, std::min(sizeof(r), rec.bytes - i));
+  } // for
+  alnum_bytes(rec.key, rec.bytes);
+} // ScanIterator::gen_record
 
-void random_generate(Record_t &record) {
-  static Record_t *dup = nullptr;
-  if (dup == nullptr) {
-    dup = new Record_t;
-    gen_record(*dup);
+void ScanIterator::random_generate(Stream &stream, Record_t &record) {
+  if (stream.dup == nullptr) {
+    stream.dup.reset(new Record_t);
+    gen_record(stream.prng, *stream.dup);
   }
 
-  random_t r = {.i = prng_rand()};
+  random_t r = {.i = stream.prng()};
   if (r.d.use_dup > 0) {
     if (r.d.use_dup * r.d.coeff[0] + r.d.coeff[1] < r.d.gen_dup) {
-      gen_record(*dup);
+      gen_record(stream.prng, *stream.dup);
     }
-    record = *dup;
+    record = *stream.dup;
   } else {
-    gen_record(record);
+    gen_record(stream.prng, record);
   }
-} // random_generate
+} // ScanIterator::random_generate
 
-static WriteDevice input(kIn);
+/**
+ * @brief Generate \p n records of \p stream into \p out, XOR them to
+ * \p witness
+ *
+ */
+void ScanIterator::generate(Stream &stream, RecordArr_t out,
+                            RowCount const n, Record_t &witness) {
+  for (RowCount i = 0; i < n; ++i) {
+    random_generate(stream, out[i]);
+  } // for
+  witness_xor(witness, out, n);
+} // ScanIterator::generate
 
-bool ScanIterator::next() {
+/**
+ * @brief Generate the next rows, copy them to the input file
+ *
+ */
+RowCount ScanIterator::next_batch(RecordArr_t out, RowCount const max) {
   TRACE(true);
 
-  RecordArr_t records = _plan->_rcache;
+  RowCount const n = std::min(max, _plan->_count - _count);
+  if (n == 0) {
+    return 0;
+  }
 
-  static bool _final = false;
+  // split the batch at block boundaries; block b continues stream
+  // b % kGenStreams, so a task takes the blocks of one stream in order and
+  // no stream jumps while generating
+  RowCount const first = _count / kGenBlock;
+  RowCount const n_blocks = (_count + n - 1) / kGenBlock - first + 1;
+  std::size_t const n_tasks = std::min<RowCount>(kGenStreams, n_blocks);
+  std::vector<std::vector<RowCount>> bounds(n_tasks); // begin, end of blocks
+  for (RowCount i = 0; i < n;) {
+    RowCount const at = _count + i;
+    std::vector<RowCount> &task = bounds[(at / kGenBlock - first) % n_tasks];
+    task.push_back(i);
+    i = std::min(n, i + kGenBlock - at % kGenBlock);
+    task.push_back(i);
+  } // for
 
-  if (_count >= _plan->_count) {
-    if (_count % _kRowCache != 0 && !_final) {
-      input.append_only(reinterpret_cast<char *>(records.data()),
-                        (_count % _kRowCache) * Record_t::bytes);
-      _final = true;
-    }
-    return false;
+  RecordArr_t witness(n_tasks);
+  auto task = [&](std::size_t const k) {
+    Stream &stream = _streams[(first + k) % kGenStreams];
+    witness[k].fill(0);
+    for (std::size_t b = 0; b < bounds[k].size(); b += 2) {
+      if ((_count + bounds[k][b]) % kGenBlock == 0) {
+        stream.dup.reset(); // a block starts without a repeated record
+      }
+      generate(stream, out + bounds[k][b], bounds[k][b + 1] - bounds[k][b],
+               witness[k]);
+    } // for
+  };
+  if (_pool == nullptr || n_tasks == 1) {
+    for (std::size_t k = 0; k < n_tasks; ++k) {
+      task(k);
+    } // for
+  } else {
+    std::vector<std::future<void>> tasks;
+    for (std::size_t k = 0; k < n_tasks; ++k) {
+      tasks.push_back(_pool->submit([&task, k] { task(k); }));
+    } // for
+    for (std::future<void> &done : tasks) {
+      done.get();
+    } // for
   }
 
-  random_generate(records[_count % _kRowCache]);
-
   // witness for input
-  (*(_plan->_inputWitnessRecord.get())).x_or(records[_count % _kRowCache]);
-
-  ++_count;
-
-  if (_count % _kRowCache == 0) {
-    input.append_only(reinterpret_cast<char *>(records.data()),
-                      _kRowCache * Record_t::bytes);
-  }
+  for (std::size_t k = 0; k < n_tasks; ++k) {
+    (*(_plan->_inputWitnessRecord.get())).x_or(witness[k]);
+  } // for
 
-  return true;
-} // ScanIterator::next
+  _in.append_only(reinterpret_cast<char *>(out.data()), n * Record_t::bytes);
+  _count += n;
+  return n;
+} // ScanIterator::next_batch
@@ -1,11 +1,52 @@
+#include "Device.h"
 #include "Iterator.h"
 #include "Record.h"
+#include "ThreadPool.h"
+#include "Utils.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Fast random generator, xoshiro256+ seeded with splitmix64
+ * @ref https://prng.di.unimi.it
+ *
+ * jump() advances the state by 2^128 draws, so generators jumped a different
+ * number of times from one seed draw non-overlapping streams.
+ */
+class Prng {
+public:
+  explicit Prng(uint64_t const seed);
+  uint64_t operator()();
+  void jump();
+
+private:
+  uint64_t _s[4];
+}; // class Prng
+
+/**
+ * @brief Map every byte of \p bytes to one of [0-9A-Za-z]
+ *
+ * The low 6 bits pick the character, 62 and 63 wrap around to '0' and '1'.
+ * Runs with AVX2 if the CPU has it, the result is the same either way.
+ */
+void alnum_bytes(uint8_t *const bytes, std::size_t const n);
+void alnum_bytes_scalar(uint8_t *const bytes, std::size_t const n);
 
 class ScanPlan : public Plan {
   friend class ScanIterator;
 
 public:
-  ScanPlan(RowCount const count);
+  /**
+   * @brief Construct a new ScanPlan object
+   *
+   * @param prefix of the input copy in kDir
+   * @param seed of the records, the same seed generates the same records
+   */
+  ScanPlan(RowCount const count, std::string const &prefix = "",
+           uint64_t const seed = scanSeed());
   ~ScanPlan();
   Iterator *init() const override;
   inline RecordArr_t const &records() const override { return _rcache; }
@@ -15,6 +56,8 @@ public:
 
 private:
   RowCount const _count;
+  std::string const _prefix;
+  uint64_t const _seed;
   // Cache-resident records
   RecordArr_t const _rcache;
   std::unique_ptr<Record_t> const _inputWitnessRecord;
@@ -24,11 +67,27 @@ class ScanIterator : public Iterator {
 public:
   ScanIterator(ScanPlan const *const plan);
   ~ScanIterator();
-  bool next();
+  RowCount next_batch(RecordArr_t out, RowCount const max) override;
 
 private:
+  /**
+   * @brief Random stream of every kGenStreams-th block of kGenBlock records
+   *
+   */
+  struct Stream {
+    Prng prng;
+    std::unique_ptr<Record_t> dup; // repeated record, null at a block start
+  };
+
+  static void gen_record(Prng &prng, Record_t &rec);
+  static void random_generate(Stream &stream, Record_t &record);
+  static void generate(Stream &stream, RecordArr_t out, RowCount const n,
+                       Record_t &witness);
+
   ScanPlan const *const _plan;
   RowCount _count;
-  // max number of rows in cache
-  const RowCount _kRowCache;
+
+  std::vector<Stream> _streams; // jumped apart once, when the scan starts
+  std::unique_ptr<ThreadPool> _pool; // null if single thread
+  WriteDevice _in;                   // copy of the generated input
 }; // class ScanIterator
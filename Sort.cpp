@@ -1,24 +1,54 @@
 #include "Sort.h"
 #include "Consts.h"
 #include "Device.h"
+#include "MergePlanner.h"
 #include "Record.h"
+#include "RunGen.h"
 #include "SortFunc.h"
 #include "Utils.h"
 #include "defs.h"
+#include <chrono>
 #include <climits>
 #include <cstdint>
+#include <cstring>
+#include <spdlog/spdlog.h>
 #include <sys/types.h>
 
-SortPlan::SortPlan(Plan *const input)
-    : _input(input), _rcache(input->records()), _icache(input->records()),
-      _rmem(RecordArr_t(std::shared_ptr<Record_t>(
-                            reinterpret_cast<Record_t *>(new char[kMemSize])),
-                        fmem_nrecords())),
-      ssd(std::make_unique<Device>(kSSD, 0.1, 200, 10 * 1024)),
-      hdd(std::make_unique<Device>(kHDD, 5, 100, ULONG_MAX)),
-      hddout(std::make_unique<Device>(kOut, 5, 100, ULONG_MAX)),
-      _inputWitnessRecord(_input->witnessRecord()), _dup_remove(isDistinct()) {
+SortPlan::SortPlan(Plan *const input, std::string const &prefix)
+    : _input(input), _prefix(prefix), _rcache(input->records()),
+      _icache(input->records()),
+      _rmem(RecordArr_t(aligned_records(Config::mem_size), fmem_nrecords())),
+      ssd(std::make_unique<Device>(prefix + kSSD, Config::ssd.latency,
+                                   Config::ssd.bandwidth,
+                                   Config::ssd_size / (1024 * 1024), kIoDepth,
+                                   isDirectIo())),
+      hdd(std::make_unique<Device>(prefix + kHDD, Config::hdd.latency,
+                                   Config::hdd.bandwidth, ULONG_MAX, kIoDepth,
+                                   isDirectIo())),
+      hddout(std::make_unique<Device>(prefix + kOut, Config::hdd.latency,
+                                      Config::hdd.bandwidth, ULONG_MAX,
+                                      kIoDepth, isDirectIo())),
+      dup_out(std::make_unique<WriteDevice>(prefix + kDupOut)),
+      _inputWitnessRecord(_input->witnessRecord()), _dup_remove(isDistinct()),
+      _sort_mode(sortMode()), _merge_threads(mergeThreads()),
+      _run_gen(runGen()) {
   TRACE(true);
+  if (_merge_threads > 1 && _dup_remove) {
+    spdlog::warn("MERGE_THREADS={} ignored: removing duplicates needs the "
+                 "final merge in one stream",
+                 _merge_threads);
+  }
+  std::size_t const n_workers = sort_nworkers();
+  if (n_workers > 0) {
+    // the cache runs of the sort tasks sit between the output buffer and
+    // the merge memory
+    _pool = std::make_unique<ThreadPool>(sortThreads());
+    RecordArr_t const whole = _rmem.whole();
+    for (std::size_t i = 0; i < n_workers; ++i) {
+      _rworkers.emplace_back(RecordArr_t(
+          whole.ptr((1 + i) * Config::cache_size), fcache_nrecords()));
+    } // for
+  }
 } // SortPlan::SortPlan
 
 SortPlan::~SortPlan() {
@@ -36,33 +66,79 @@ SortIterator::SortIterator(SortPlan const *const plan)
       _kRowCacheRun(cache_nrecords()), _kRowMergeRun(mmem_nrecords()),
       _kRowMemRun(mem_nrecords()), _kRowMemOut(out_nrecords()),
       _kRowSSDRun(ssd_nrecords()), _kRunCache(cache_nruns()),
-      _kRunMem(mem_nruns()), _kRunSSD(ssd_nruns()) {
+      _kRunMem(mem_nruns()), _kRunSSD(ssd_nruns()),
+      _sorting(plan->_rworkers.size()), _slot(0), _mem_offset(0),
+      _finished(false), _drained(false) {
   TRACE(true);
 } // SortIterator::SortIterator
 
 SortIterator::~SortIterator() {
   TRACE(true);
+  wait_sorts();
 
   delete _input;
   traceprintf("produced %lu of %lu rows\n", (unsigned long)(_produced),
               (unsigned long)(_consumed));
 } // SortIterator::~SortIterator
 
-bool SortIterator::next() {
+/**
+ * @brief Sort the whole input on the first call, then hand out its rows
+ *
+ */
+RowCount SortIterator::next_batch(RecordArr_t out, RowCount const max) {
   TRACE(true);
-  static uint64_t mem_offset = 0;
-  static bool finished = false;
+  while (consume_run()) {
+  } // while
+  if (_drained) {
+    return 0;
+  }
+  if (_output == nullptr) {
+    _output = std::make_unique<ReadDevice>(_plan->_prefix + kOut,
+                                           isDirectIo());
+  }
+
+  ::ssize_t const bytes =
+      _output->read_some(reinterpret_cast<char *>(out.data()),
+                         max * Record_t::bytes);
+  RowCount const n = bytes > 0 ? bytes / Record_t::bytes : 0;
+  for (RowCount i = 0; i < n; ++i) {
+    if (out[i].isfilled()) {
+      _drained = true;
+      return i; // padding ends the output
+    }
+  } // for
+  return n;
+} // SortIterator::next_batch
 
-  if (finished) {
+/**
+ * @brief Consume the next cache run of the input, or finish the sort
+ *
+ * @return false once the input is sorted
+ */
+bool SortIterator::consume_run() {
+  TRACE(true);
+  if (_finished) {
     return false;
   }
 
-  do {
-    if (!_input->next()) {
+  if (_plan->_run_gen != RunGen::Cache) {
+    generate_sort();
+    trace_phase();
+    _finished = true;
+    return false;
+  }
+
+  // the input writes the cache run in place
+  RecordArr_t cache = _plan->_rcache.records;
+  for (RowCount filled = 0; filled < _kRowCacheRun;) {
+    RowCount const n =
+        _input->next_batch(cache + filled, _kRowCacheRun - filled);
+    if (n == 0) {
       break;
     }
-    ++_consumed;
-  } while ((_consumed % _kRowCacheRun) != 0);
+    filled += n;
+    _consumed += n;
+  } // for
 
   Index_r indexr = _plan->_icache.index;
   RecordArr_t in = _plan->_rmem.work;
@@ -73,13 +149,15 @@ bool SortIterator::next() {
 
   if (_produced >= _consumed) {
     // final merge step
+    wait_sorts();
     if (_consumed <= _kRowMemRun) {
       // memory is not full, merge all cache-sized runs in memory to out
       inmem_merge(
           in, {_kRowMemOut, out}, hddout, indexr,
           {_kRowCacheRun, (_consumed + _kRowCacheRun - 1) / _kRowCacheRun},
-          _plan->_dup_remove, true);
-      finished = true;
+          dup_out(), true);
+      trace_phase();
+      _finished = true;
       return false;
     }
     if (_kRowMemRun < _consumed && _consumed < 2 * _kRowMemRun) {
@@ -88,8 +166,9 @@ bool SortIterator::next() {
                         {_kRowCacheRun, _kRunMem},
                         (_consumed - _kRowMemRun + _kRowCacheRun - 1) /
                             _kRowCacheRun,
-                        _plan->_dup_remove);
-      finished = true;
+                        dup_out());
+      trace_phase();
+      _finished = true;
       return false;
     }
 
@@ -103,7 +182,7 @@ bool SortIterator::next() {
       // merge remaining runs in memory to ssd (create the last run in ssd)
       RowCount n_runs = (inmem_rem + _kRowCacheRun - 1) / _kRowCacheRun;
       inmem_merge(in, {_kRowMemOut, out}, out_dev, indexr,
-                  {_kRowCacheRun, n_runs}, _plan->_dup_remove);
+                  {_kRowCacheRun, n_runs}, dup_out());
       // fill the last run in ssd
       inmem_rem = _kRowMemRun - _kRowCacheRun * n_runs;
       if (inmem_rem != 0) {
@@ -115,10 +194,10 @@ bool SortIterator::next() {
       // input ends with multiple runs in ssd (none in hdd), merge to out
       uint32_t n_runs = (_consumed + _kRowMemRun - 1) / _kRowMemRun;
       uint32_t run_size = _kRowMergeRun / n_runs;
-      external_merge(in, {_kRowMemOut, out}, {ssd, hddout}, indexr,
-                     {{run_size, n_runs}, _kRowMemRun}, _plan->_dup_remove,
-                     true);
-      finished = true;
+      final_merge(in, out, {ssd, hddout}, indexr,
+                  {{run_size, n_runs}, _kRowMemRun});
+      trace_phase();
+      _finished = true;
       return false;
     }
 
@@ -129,8 +208,9 @@ bool SortIterator::next() {
       uint32_t run_size = _kRowMergeRun / (_kRunSSD + n_runs_hdd);
       external_spill_merge(in, {_kRowMemOut, out}, {ssd, hddout}, hdd, indexr,
                            {{run_size, _kRunSSD}, _kRowMemRun}, n_runs_hdd,
-                           _plan->_dup_remove);
-      finished = true;
+                           dup_out());
+      trace_phase();
+      _finished = true;
       return false;
     }
 
@@ -140,74 +220,70 @@ bool SortIterator::next() {
       uint32_t n_runs = (ssd_rem + _kRowMemRun - 1) / _kRowMemRun;
       uint32_t run_size = _kRowMergeRun / n_runs;
       external_merge(in, {_kRowMemOut, out}, {ssd, hdd}, indexr,
-                     {{run_size, n_runs}, _kRowMemRun}, _plan->_dup_remove);
+                     {{run_size, n_runs}, _kRowMemRun}, dup_out());
       // fill the last run in hdd
       ssd_rem = _kRowSSDRun - _kRowMemRun * n_runs;
       fill_run(hdd, out, ssd_rem);
     }
 
-    // merge all the remaining hdd runs to hddout (nested)
-    uint32_t exrun_size, n_runs, run_size, n_subruns;
-    exrun_size = _kRowSSDRun;
-    n_runs = (_consumed + exrun_size - 1) / exrun_size;
-    run_size = _kRowMergeRun / n_runs;
-    if (run_size < minm_nrecords()) {
-      run_size = minm_nrecords();
+    // merge all the remaining hdd runs to hddout along the cheapest tree
+    RowCount const n_runs = (_consumed + _kRowSSDRun - 1) / _kRowSSDRun;
+    std::vector<RunDesc> runs;
+    for (RowCount i = 0; i < n_runs; ++i) {
+      runs.push_back({hdd, i * _kRowSSDRun, _kRowSSDRun});
+    } // for
+    MergePlanner const planner(_kRowMergeRun, _kRowMemOut, indexr.size(), hdd,
+                               hddout, minm_nrecords());
+    MergePlan const plan = planner.plan(runs);
+    if (plan.steps.size() == 1) {
+      auto const start = std::chrono::steady_clock::now();
+      // equal runs, final_merge may split them over the merge threads
+      final_merge(in, out, {hdd, hddout}, indexr,
+                  {{_kRowMergeRun / n_runs, n_runs}, _kRowSSDRun});
+      log_planned_merge(plan, start);
+    } else {
+      planned_merge(in, {_kRowMemOut, out}, std::move(runs), plan, hdd,
+                    hddout, indexr, dup_out());
     }
-    n_subruns = _kRowMergeRun / run_size;
-    while (n_subruns < n_runs) {
-      for (uint32_t i = 0; i < n_runs; i += n_subruns) {
-        external_merge(
-            in, {_kRowMemOut, out}, {hdd, hdd}, indexr,
-            {{run_size, (i + n_subruns > n_runs) ? n_runs - i : n_subruns},
-             exrun_size},
-            _plan->_dup_remove);
-        if (i + n_subruns > n_runs) {
-          uint32_t rem_size = (i + n_subruns - n_runs) * exrun_size;
-          fill_run(hdd, out, rem_size);
-
-          hdd->set_base(n_runs * exrun_size * Record_t::bytes);
-        } else {
-          hdd->set_base((i + n_subruns) * exrun_size * Record_t::bytes);
-        }
-      }
-      exrun_size = n_subruns * exrun_size;
-      n_runs = (_consumed + exrun_size - 1) / exrun_size;
-      run_size = _kRowMergeRun / n_runs;
-      if (run_size < minm_nrecords()) {
-        run_size = minm_nrecords();
-      }
-      n_subruns = _kRowMergeRun / run_size;
-    }
-    external_merge(in, {_kRowMemOut, out}, {hdd, hddout}, indexr,
-                   {{run_size, n_runs}, exrun_size}, _plan->_dup_remove, true);
-    finished = true;
+    trace_phase();
+    _finished = true;
     return false;
   } // if produced >= consumed
 
   if (_kRowMemRun < _consumed && _consumed <= 2 * _kRowMemRun) {
     // spilling mem->ssd: dump the candidate cache run to ssd
-    ssd->eappend(reinterpret_cast<char *>((in + mem_offset).data()),
+    ssd->eappend(reinterpret_cast<char *>((in + _mem_offset).data()),
                  _kRowCacheRun * Record_t::bytes);
   }
 
   // sort cache run and dump to memory
-  RecordArr_t records = _plan->_rcache.records;
-  Index_t indext = _plan->_rcache.index;
-
-  RecordArr_t work = _plan->_rmem.work + mem_offset;
-  incache_sort(records, work, indext, _consumed - _produced);
-  mem_offset += _consumed - _produced;
-  if (_consumed % _kRowCacheRun != 0) {
-    // last cache run is not full, fill
-    work[_consumed % _kRowCacheRun].fill();
+  RowCount const n_records = _consumed - _produced;
+  RecordArr_t work = _plan->_rmem.work + _mem_offset;
+  if (_plan->_pool == nullptr) {
+    sort_run(_plan->_sort_mode, _plan->_rcache, work, n_records);
+  } else {
+    // hand a copy to a sort task, the scan refills its buffer meanwhile
+    std::size_t const slot = _slot++ % _sorting.size();
+    if (_sorting[slot].valid()) {
+      _sorting[slot].get();
+    }
+    SortPlan::CacheRun const *run = &_plan->_rworkers[slot];
+    std::memcpy(reinterpret_cast<char *>(run->records.data()),
+                reinterpret_cast<char *>(_plan->_rcache.records.data()),
+                n_records * Record_t::bytes);
+    _sorting[slot] = _plan->_pool->submit(
+        [mode = _plan->_sort_mode, run, work, n_records] {
+          sort_run(mode, *run, work, n_records);
+        });
   }
+  _mem_offset += n_records;
   _produced = _consumed;
 
   if (_consumed % _kRowMemRun == 0) {
     // when memory is full
+    wait_sorts();
 
-    mem_offset = 0; // reset offset
+    _mem_offset = 0; // reset offset
 
     if (_consumed >= 2 * _kRowMemRun) {
       // not spilling, eager merge mem runs to ssd
@@ -217,7 +293,7 @@ bool SortIterator::next() {
       // out_dev=ssd: merge all cache-sized runs in memory to ssd
       // out_dev=hdd: spill from ssd to hdd
       inmem_merge(in, {_kRowMemOut, out}, out_dev, indexr,
-                  {_kRowCacheRun, _kRunMem}, _plan->_dup_remove);
+                  {_kRowCacheRun, _kRunMem}, dup_out());
     }
     if (_consumed == 2 * _kRowMemRun) {
       // merge the first block of unmerged runs in ssd due to spilling
@@ -226,7 +302,7 @@ bool SortIterator::next() {
       uint64_t cur_pos = ssd->get_pos();
       ssd->clear();
       inmem_merge(in, {_kRowMemOut, out}, ssd, indexr,
-                  {_kRowCacheRun, _kRunMem}, _plan->_dup_remove);
+                  {_kRowCacheRun, _kRunMem}, dup_out());
       ssd->eseek(cur_pos);
     }
   } // if
@@ -238,13 +314,13 @@ bool SortIterator::next() {
     if (_consumed >= 2 * _kRowSSDRun) {
       // merge all ssd runs to hdd
       external_merge(in, {_kRowMemOut, out}, {ssd, hdd}, indexr,
-                     {{run_size, _kRunSSD}, _kRowMemRun}, _plan->_dup_remove);
+                     {{run_size, _kRunSSD}, _kRowMemRun}, dup_out());
       ssd->clear();
     }
     if (_consumed == 2 * _kRowSSDRun) {
       // merge all spilled ssd runs to hdd (first to ssd then bulk write to hdd)
       external_merge(in, {_kRowMemOut, out}, {hdd, ssd}, indexr,
-                     {{run_size, _kRunSSD}, _kRowMemRun}, _plan->_dup_remove);
+                     {{run_size, _kRunSSD}, _kRowMemRun}, dup_out());
       RecordArr_t whole = _plan->_rmem.whole();
       for (uint32_t i = 0; i < _kRunSSD; ++i) {
         ssd->eread(reinterpret_cast<char *>(whole.data()),
@@ -258,5 +334,123 @@ bool SortIterator::next() {
     }
   } // if
 
+  if (_consumed % _kRowMemRun == 0) {
+    trace_phase(); // memory, and maybe ssd, turned over
+  }
+
   return true;
-} // SortIterator::next
+} // SortIterator::consume_run
+
+/**
+ * @brief Sort the whole input with replacement selection or natural runs
+ *
+ * The runs are merged, in as many passes as the fan-in needs, through the
+ * HDD into the output device. Natural runs of sorted input are written to the
+ * output device right away, unless duplicates are removed by the merge.
+ */
+void SortIterator::generate_sort() {
+  RecordArr_t cache = _plan->_rcache.records; // where the scan puts a record
+  RecordArr_t out = _plan->_rmem.out;
+  Index_r indexr = _plan->_icache.index;
+  Device *ssd = _plan->ssd.get();
+  Device *hdd = _plan->hdd.get();
+  Device *hddout = _plan->hddout.get();
+
+  auto generate = [&](auto &generator) {
+    for (RowCount n; (n = _input->next_batch(cache, _kRowCacheRun)) > 0;) {
+      for (RowCount i = 0; i < n; ++i) {
+        generator.push(cache[i]);
+      } // for
+      _consumed += n;
+    } // for
+    return generator.finish();
+  };
+  std::vector<RunDesc> runs;
+  if (_plan->_run_gen == RunGen::Replacement) {
+    ReplacementSelection rs(_plan->_rmem.work, {_kRowMemOut, out}, ssd, hdd);
+    runs = generate(rs);
+  } else {
+    NaturalRuns nr(_plan->_rmem.work, _plan->_rcache.index,
+                   {_kRowMemOut, out}, ssd, hdd,
+                   _plan->_dup_remove ? nullptr : hddout);
+    runs = generate(nr);
+  }
+  _produced = _consumed;
+  trace_phase();
+
+  RecordArr_t in = _plan->_rmem.work;
+  runs_merge(in, {_kRowMemOut, out}, std::move(runs), hdd, hddout, indexr,
+             dup_out());
+} // SortIterator::generate_sort
+
+/**
+ * @brief Sort a cache run of \p n_records records into \p work
+ *
+ * A cache run that is not full is ended by a filled record.
+ */
+void SortIterator::sort_run(SortMode const mode, SortPlan::CacheRun const &run,
+                            RecordArr_t work, RowCount const n_records) {
+  RecordArr_t records = run.records;
+  run.index.visit([&](auto &index) {
+    switch (mode) {
+    case SortMode::Radix:
+      incache_radix_sort(records, work, index, n_records);
+      break;
+    case SortMode::Prefix: {
+      Index_p indexp = run.prefix;
+      incache_prefix_sort(records, work, indexp, n_records);
+      break;
+    }
+    default:
+      incache_sort(records, work, index, n_records);
+    } // switch
+  });
+  if (n_records < cache_nrecords()) {
+    // last cache run is not full, fill
+    work[n_records].fill();
+  }
+} // SortIterator::sort_run
+
+/**
+ * @brief Merge the device runs of all input records into the output device
+ *
+ * Key-range partitions are merged in parallel unless duplicates are removed,
+ * which needs the records in one stream.
+ */
+void SortIterator::final_merge(RecordArr_t &in, RecordArr_t &out,
+                               DeviceInOut dev, Index_r &index,
+                               ExRunInfo run_info) {
+  if (_plan->_merge_threads > 1 && !_plan->_dup_remove) {
+    parallel_external_merge(in, {_kRowMemOut, out}, dev, index, run_info,
+                            _consumed, _plan->_merge_threads);
+  } else {
+    external_merge(in, {_kRowMemOut, out}, dev, index, run_info, dup_out(),
+                   true);
+  }
+} // SortIterator::final_merge
+
+/**
+ * @brief Barrier: wait for the cache runs handed to sort tasks
+ *
+ */
+void SortIterator::wait_sorts() {
+  for (auto &sorting : _sorting) {
+    if (sorting.valid()) {
+      sorting.get();
+    }
+  } // for
+} // SortIterator::wait_sorts
+
+/**
+ * @brief Where the merges put removed duplicates, null to keep them
+ *
+ */
+WriteDevice *SortIterator::dup_out() const {
+  return _plan->_dup_remove ? _plan->dup_out.get() : nullptr;
+} // SortIterator::dup_out
+
+void SortIterator::trace_phase() {
+  _plan->ssd->trace_phase();
+  _plan->hdd->trace_phase();
+  _plan->hddout->trace_phase();
+} // SortIterator::trace_phase
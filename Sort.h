@@ -2,15 +2,26 @@
 #include "Device.h"
 #include "Iterator.h"
 #include "Record.h"
+#include "SortFunc.h"
+#include "ThreadPool.h"
 #include "Utils.h"
 #include <cstdint>
+#include <future>
 #include <memory>
+#include <string>
+#include <vector>
 
 class SortPlan : public Plan {
   friend class SortIterator;
 
 public:
-  SortPlan(Plan *const input);
+  /**
+   * @brief Construct a new SortPlan object
+   *
+   * @param prefix of the device files in kDir, sorts side by side in one
+   * process each take their own
+   */
+  SortPlan(Plan *const input, std::string const &prefix = "");
   ~SortPlan();
   Iterator *init() const override;
   Record_t const &witnessRecord() const override { return _inputWitnessRecord; }
@@ -19,30 +30,37 @@ public:
 private:
   struct CacheRun {
     RecordArr_t records;
-    Index_t index;
+    CacheIndex index;
+    Index_p prefix;
     CacheRun(RecordArr_t const &records)
         : records(records.ptr(), cache_nrecords()),
-          index(ptr_cast<Record_t, uint16_t>(
-                    records.ptr(cache_nrecords() * Record_t::bytes)),
-                cache_nrecords()) {}
+          index(records.ptr(cache_index_offset()), cache_nrecords(),
+                cache_index_bytes()),
+          prefix(sortMode() == SortMode::Prefix
+                     ? Index_p(ptr_cast<Record_t, PrefixInd>(
+                                   records.ptr(cache_index_offset())),
+                               cache_nrecords())
+                     : Index_p()) {}
   }; // struct CacheRun
   struct CacheInd {
     Index_r index;
     CacheInd(RecordArr_t const &records)
         : index(ptr_cast<Record_t, MergeInd>(records.ptr()),
-                kCacheSize / sizeof(MergeInd)) {}
+                Config::cache_size / sizeof(MergeInd)) {}
   }; // struct CacheInd
   struct MemRun {
     RecordArr_t out;
     RecordArr_t work;
     MemRun(RecordArr_t const &records)
         : out(records.ptr(), out_nrecords()),
-          work(records.ptr(kCacheSize), mmem_nrecords()) {}
+          work(records.ptr((1 + sort_nworkers()) * Config::cache_size),
+               mmem_nrecords()) {}
     RecordArr_t whole() const {
       return RecordArr_t(out.ptr(), fmem_nrecords());
     }
   }; // struct MemRun
   Plan *const _input;
+  std::string const _prefix;
   CacheRun _rcache;
   CacheInd _icache;
   MemRun _rmem;
@@ -50,18 +68,35 @@ private:
   std::unique_ptr<Device> ssd;
   std::unique_ptr<Device> hdd;
   std::unique_ptr<Device> hddout;
+  std::unique_ptr<WriteDevice> dup_out; // removed duplicates and their counts
 
   Record_t const &_inputWitnessRecord;
   bool const _dup_remove;
+  SortMode const _sort_mode;
+  std::size_t const _merge_threads;
+  RunGen const _run_gen;
+
+  std::unique_ptr<ThreadPool> _pool; // sorts mini runs, null if single thread
+  std::vector<CacheRun> _rworkers;   // cache run handed to a sort task
 }; // class SortPlan
 
 class SortIterator : public Iterator {
 public:
   SortIterator(SortPlan const *const plan);
   ~SortIterator();
-  bool next();
+  RowCount next_batch(RecordArr_t out, RowCount const max) override;
 
 private:
+  bool consume_run();
+  void trace_phase();
+  void wait_sorts();
+  WriteDevice *dup_out() const;
+  void generate_sort();
+  void final_merge(RecordArr_t &in, RecordArr_t &out, DeviceInOut dev,
+                   Index_r &index, ExRunInfo run_info);
+  static void sort_run(SortMode const mode, SortPlan::CacheRun const &run,
+                       RecordArr_t work, RowCount const n_records);
+
   SortPlan const *const _plan;
   Iterator *const _input;
   RowCount _consumed, _produced;
@@ -76,4 +111,11 @@ private:
   RunCount const _kRunCache;
   RunCount const _kRunMem;
   RunCount const _kRunSSD;
+
+  std::vector<std::future<void>> _sorting; // sort task of each cache run
+  std::size_t _slot;                       // cache run of the next task
+  RowCount _mem_offset; // end of the sorted cache runs in memory
+  bool _finished;
+  std::unique_ptr<ReadDevice> _output; // sorted rows, once finished
+  bool _drained;                       // _output reached its padding
 }; // class SortIterator
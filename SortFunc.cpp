@@ -1,177 +1,274 @@
 #include <spdlog/spdlog.h>
 
 #include "Consts.h"
+#include "FixedRecord.h"
 #include "Iterator.h"
-#include "LoserTree.h"
+#include "MergeEngine.h"
+#include "MergePlanner.h"
 #include "Record.h"
 #include "SortFunc.h"
+#include "ThreadPool.h"
+#include "Utils.h"
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstddef>
 #include <cstdio>
-
-void apply_permut(RecordArr_t &records, Index_t &index,
-                  RowCount const n_records) {
-  for (uint16_t i = 0; i < n_records; i++) {
-    uint16_t current = i;
-    while (i != index[current]) {
-      uint16_t next = index[current];
-      swap(records[current], records[next]);
-      index[current] = current;
+#include <cstring>
+#include <future>
+#include <numeric>
+#include <vector>
+
+template <class Fixed, class Ind>
+static void apply_permut(RecordArr_t &records, Index<Ind> &index,
+                         RowCount const n_records) {
+  Ind *const ind = index.data(); // sort_index checked the range
+  for (RowCount i = 0; i < n_records; i++) {
+    Ind current = i;
+    while (i != ind[current]) {
+      Ind next = ind[current];
+      Fixed::swap(Fixed::at(records, current), Fixed::at(records, next));
+      ind[current] = current;
       current = next;
     }
-    index[current] = current;
+    ind[current] = current;
   }
 } // apply_permut (in-place)
 
-void apply_permut(RecordArr_t const &records, RecordArr_t &out,
-                  Index_t const &index, RowCount const n_records) {
-  for (uint16_t i = 0; i < n_records; i++) {
-    out[i] = records[index[i]];
+template <class Fixed, class Ind>
+static void apply_permut(RecordArr_t const &records, RecordArr_t &out,
+                         Index<Ind> const &index, RowCount const n_records) {
+  if (n_records > out.size()) {
+    throw std::out_of_range("apply_permut: out of range");
+  }
+  Ind const *const ind = index.data();
+  for (RowCount i = 0; i < n_records; i++) {
+    Fixed::copy(Fixed::at(out, i), Fixed::at(records, ind[i]));
   }
 } // apply_permut (out-of-place)
 
-void incache_sort(RecordArr_t &records, Index_t &index,
-                  RowCount const n_records) {
+/**
+ * @brief Sort the first \p n_records entries of \p index by their records
+ *
+ */
+template <class Fixed, class Ind>
+static void sort_index(RecordArr_t const &records, Index<Ind> &index,
+                       RowCount const n_records) {
   auto begin = index.begin();
   auto end = index.begin() + n_records;
-  if (end > index.end()) {
+  if (end > index.end() || n_records > records.size()) {
     throw std::out_of_range("incache_sort: index out of range");
   } // if
 
-  for (uint16_t i = 0; i < end - begin; ++i) {
-    index[i] = i;
-  } // for
-  std::sort(begin, end, [&records](uint32_t const a, uint32_t const b) {
-    return records[a] < records[b];
+  std::iota(begin, end, 0);
+  std::sort(begin, end, [&records](Ind const a, Ind const b) {
+    return Fixed::less(Fixed::at(records, a), Fixed::at(records, b));
   });
+} // sort_index
 
-  apply_permut(records, index, end - begin);
+template <class Ind>
+void incache_sort(RecordArr_t &records, Index<Ind> &index,
+                  RowCount const n_records) {
+  with_record_size([&](auto fixed) {
+    using Fixed = decltype(fixed);
+    sort_index<Fixed>(records, index, n_records);
+    apply_permut<Fixed>(records, index, n_records);
+  });
 } // incache_sort (in-place)
 
-void incache_sort(RecordArr_t const &records, RecordArr_t &out, Index_t &index,
-                  RowCount const n_records) {
+template <class Ind>
+void incache_sort(RecordArr_t const &records, RecordArr_t &out,
+                  Index<Ind> &index, RowCount const n_records) {
   spdlog::info("STATE -> SORT_MINI_RUNS: Sort cache-size mini runs");
-  auto begin = index.begin();
-  auto end = index.begin() + n_records;
-  if (end > index.end()) {
-    throw std::out_of_range("incache_sort: index out of range");
-  } // if
-
-  for (uint16_t i = 0; i < end - begin; ++i) {
-    index[i] = i;
-  } // for
-  std::sort(begin, end, [&records](uint32_t const a, uint32_t const b) {
-    return records[a] < records[b];
+  with_record_size([&](auto fixed) {
+    using Fixed = decltype(fixed);
+    sort_index<Fixed>(records, index, n_records);
+    apply_permut<Fixed>(records, out, index, n_records);
   });
-
-  apply_permut(records, out, index, end - begin);
 } // incache_sort (out-of-place)
 
-static WriteDevice dup_out(kDupOut); // record + uin64_t count
-
-void inmem_merge(RecordArr_t const &records, OutBuffer out, Device *hd,
-                 Index_r &index, RunInfo run_info, bool dup_remove,
-                 bool no_fill) {
-  spdlog::info("STATE -> MERGE_RUNS_{0}: Merge sorted runs on the {0} device",
-               hd->name);
-  static Record_t *_prev_record = nullptr;
-  if (dup_remove && _prev_record == nullptr) {
-    _prev_record = new Record_t;
-  }
-  if (dup_remove) {
-    _prev_record->fill();
-  }
-
-  RowCount const run_size = run_info.run_size;
-  RowCount const n_runs = run_info.n_runs;
-
-  Level level(ceil(log2(n_runs)));
-  uint64_t capacity = 1 << level;
-  auto end = index.begin() + capacity;
-  if (end > index.end()) {
-    throw std::out_of_range("inmem_merge: index out of range");
-  } // if
-
-  auto get_record = [&records,
-                     &run_size](MergeInd const &mind) -> Record_t const & {
-    return records[mind.run_id * run_size + mind.record_id];
+static constexpr std::ptrdiff_t kRadixCutoff = 32; // comparison sort below
+
+/**
+ * @brief MSD radix (American flag) sort of an index range by record bytes
+ *
+ * All records in [begin, end) share their first \p depth bytes. Buckets are
+ * permuted in place; a range whose records share the byte at \p depth just
+ * advances to the next byte, small ranges finish with a comparison sort.
+ */
+template <class Fixed, class Ind>
+static void radix_sort(RecordArr_t const &records, Ind *const begin,
+                       Ind *const end, std::size_t depth) {
+  std::size_t const bytes = Fixed::bytes();
+  auto byte_at = [&records](Ind const ind, std::size_t const pos) {
+    return reinterpret_cast<unsigned char const *>(
+        Fixed::at(records, ind).key)[pos];
   };
 
-  auto cmp = [&get_record, &n_runs](MergeInd const &a, MergeInd const &b) {
-    if (a.run_id >= n_runs) {
-      return false;
-    } else if (b.run_id >= n_runs) {
-      return true;
+  for (; end - begin > 1 && depth < bytes; ++depth) {
+    if (end - begin < kRadixCutoff) {
+      std::sort(begin, end, [&records, depth](Ind const a, Ind const b) {
+        return std::memcmp(Fixed::at(records, a).key + depth,
+                           Fixed::at(records, b).key + depth,
+                           Fixed::bytes() - depth) < 0;
+      });
+      return;
     }
-    return get_record(a) < get_record(b);
-  };
-
-  LoserTree ltree(level, cmp, index);
-  for (uint32_t i = 0; i < capacity; ++i) {
-    ltree.insert(i, 0);
-  }
 
-  std::size_t out_ind = 0;
-  RowCount total = 0;
-  RowCount dupRecordCount = 0;
-
-  while (!ltree.empty()) {
-    MergeInd popped = ltree.pop();
-    if (popped.run_id >= n_runs || get_record(popped).isfilled()) {
-      ltree.deleteRecordId(popped.run_id);
-      continue;
+    uint32_t count[256] = {0};
+    for (Ind *it = begin; it != end; ++it) {
+      ++count[byte_at(*it, depth)];
+    } // for
+    if (count[byte_at(*begin, depth)] == static_cast<uint32_t>(end - begin)) {
+      continue; // common prefix byte
     }
-    const Record_t &rec = get_record(popped);
-
-    if (dup_remove) {
-      if (*_prev_record != rec) {
-        if (dupRecordCount > 0) {
-          dup_out.append_only(*_prev_record, Record_t::bytes);
-          dup_out.append_only(reinterpret_cast<char *>(&dupRecordCount),
-                              sizeof(dupRecordCount));
-          dupRecordCount = 0;
+
+    Ind *head[256];
+    Ind *tail[256];
+    Ind *pos = begin;
+    for (int b = 0; b < 256; ++b) {
+      head[b] = pos;
+      pos += count[b];
+      tail[b] = pos;
+    } // for
+
+    for (int b = 0; b < 256; ++b) {
+      while (head[b] < tail[b]) {
+        Ind ind = *head[b];
+        unsigned char c = byte_at(ind, depth);
+        if (c == b) {
+          ++head[b];
+          continue;
         }
-        *_prev_record = rec;
-        out.out[out_ind++] = rec;
-        ++total;
-      } else {
-        ++dupRecordCount;
-      }
-    } else {
-      out.out[out_ind++] = rec;
-      ++total;
-    }
+        do {
+          std::swap(ind, *head[c]++);
+          c = byte_at(ind, depth);
+        } while (c != b);
+        *head[b]++ = ind;
+      } // while
+    }   // for
+
+    pos = begin;
+    for (int b = 0; b < 256; ++b) {
+      radix_sort<Fixed, Ind>(records, pos, pos + count[b], depth + 1);
+      pos += count[b];
+    } // for
+    return;
+  } // for
+} // radix_sort
+
+/**
+ * @brief Radix sort the first \p n_records entries of \p index by their
+ * records
+ *
+ */
+template <class Fixed, class Ind>
+static void radix_index(RecordArr_t const &records, Index<Ind> &index,
+                        RowCount const n_records) {
+  auto begin = index.begin();
+  auto end = index.begin() + n_records;
+  if (end > index.end() || n_records > records.size()) {
+    throw std::out_of_range("incache_radix_sort: index out of range");
+  } // if
 
-    ++popped.record_id;
-    if (popped.record_id < run_size) {
-      ltree.insert(popped.run_id, popped.record_id);
-    } else {
-      ltree.deleteRecordId(popped.run_id);
-    }
+  std::iota(begin, end, 0);
+  radix_sort<Fixed, Ind>(records, index.data(), index.data() + n_records, 0);
+} // radix_index
+
+template <class Ind>
+void incache_radix_sort(RecordArr_t &records, Index<Ind> &index,
+                        RowCount const n_records) {
+  with_record_size([&](auto fixed) {
+    using Fixed = decltype(fixed);
+    radix_index<Fixed>(records, index, n_records);
+    apply_permut<Fixed>(records, index, n_records);
+  });
+} // incache_radix_sort (in-place)
 
-    if (out_ind == out.out_size) {
-      // TODO: check return value
-      hd->eappend(reinterpret_cast<char *>(out.out.data()),
-                  out.out_size * Record_t::bytes);
-      out_ind = 0;
-    } // if
-  }
+template <class Ind>
+void incache_radix_sort(RecordArr_t const &records, RecordArr_t &out,
+                        Index<Ind> &index, RowCount const n_records) {
+  spdlog::info("STATE -> SORT_MINI_RUNS: Sort cache-size mini runs");
+  with_record_size([&](auto fixed) {
+    using Fixed = decltype(fixed);
+    radix_index<Fixed>(records, index, n_records);
+    apply_permut<Fixed>(records, out, index, n_records);
+  });
+} // incache_radix_sort (out-of-place)
+
+template void incache_sort(RecordArr_t &, Index_t &, RowCount const);
+template void incache_sort(RecordArr_t &, Index_w &, RowCount const);
+template void incache_sort(RecordArr_t const &, RecordArr_t &, Index_t &,
+                           RowCount const);
+template void incache_sort(RecordArr_t const &, RecordArr_t &, Index_w &,
+                           RowCount const);
+template void incache_radix_sort(RecordArr_t &, Index_t &, RowCount const);
+template void incache_radix_sort(RecordArr_t &, Index_w &, RowCount const);
+template void incache_radix_sort(RecordArr_t const &, RecordArr_t &, Index_t &,
+                                 RowCount const);
+template void incache_radix_sort(RecordArr_t const &, RecordArr_t &, Index_w &,
+                                 RowCount const);
+
+template <class Fixed> static inline uint64_t key_prefix(Record_t const &rec) {
+  std::size_t const n = std::min(sizeof(uint64_t), Fixed::bytes());
+  uint64_t prefix = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    prefix |= static_cast<uint64_t>(rec.key[i]) << (56 - 8 * i);
+  } // for
+  return prefix;
+} // key_prefix
 
-  if (dupRecordCount > 0) {
-    dup_out.append_only(*_prev_record, Record_t::bytes);
-    dup_out.append_only(reinterpret_cast<char *>(&dupRecordCount),
-                        sizeof(dupRecordCount));
-    dupRecordCount = 0;
-  }
+void incache_prefix_sort(RecordArr_t const &records, RecordArr_t &out,
+                         Index_p &prefix, RowCount const n_records) {
+  spdlog::info("STATE -> SORT_MINI_RUNS: Sort cache-size mini runs");
+  auto begin = prefix.begin();
+  auto end = prefix.begin() + n_records;
+  if (end > prefix.end() || n_records > records.size() ||
+      n_records > out.size()) {
+    throw std::out_of_range("incache_prefix_sort: index out of range");
+  } // if
 
-  if (out_ind > 0) {
-    // TODO: check return value
-    hd->eappend(reinterpret_cast<char *>(out.out.data()),
-                out_ind * Record_t::bytes);
-  }
+  with_record_size([&](auto fixed) {
+    using Fixed = decltype(fixed);
+    PrefixInd *const ind = prefix.data();
+    for (uint32_t i = 0; i < end - begin; ++i) {
+      ind[i] = {key_prefix<Fixed>(Fixed::at(records, i)), i};
+    } // for
+
+    // records are only touched when the prefixes tie
+    std::size_t const suffix =
+        Fixed::bytes() - std::min(sizeof(uint64_t), Fixed::bytes());
+    std::sort(begin, end,
+              [&records, suffix](PrefixInd const &a, PrefixInd const &b) {
+                if (a.prefix != b.prefix) {
+                  return a.prefix < b.prefix;
+                }
+                return suffix > 0 &&
+                       std::memcmp(
+                           Fixed::at(records, a.record_id).key +
+                               sizeof(uint64_t),
+                           Fixed::at(records, b.record_id).key +
+                               sizeof(uint64_t),
+                           suffix) < 0;
+              });
+
+    for (RowCount i = 0; i < n_records; i++) {
+      Fixed::copy(Fixed::at(out, i), Fixed::at(records, ind[i].record_id));
+    } // for
+  });
+} // incache_prefix_sort
 
-  RowCount merge_size = n_runs * run_size;
+void inmem_merge(RecordArr_t const &records, OutBuffer out, Device *hd,
+                 Index_r &index, RunInfo run_info, WriteDevice *dup_out,
+                 bool no_fill) {
+  spdlog::info("STATE -> MERGE_RUNS_{0}: Merge sorted runs on the {0} device",
+               hd->name);
+
+  MemRunSource source{records, run_info.run_size, run_info.n_runs};
+  DeviceSink sink(out, hd);
+  RowCount const total = kway_merge(source, sink, index, dup_out);
+
+  RowCount merge_size = run_info.n_runs * run_info.run_size;
   if (total < merge_size && !no_fill) {
     fill_run(hd, out.out, merge_size - total);
   }
@@ -180,391 +277,299 @@ void inmem_merge(RecordArr_t const &records, OutBuffer out, Device *hd,
 
 void inmem_spill_merge(RecordArr_t &records, OutBuffer out, DeviceInOut dev,
                        Index_r &index, RunInfo run_info,
-                       RowCount const n_runs_ssd, bool dup_remove) {
+                       RowCount const n_runs_ssd, WriteDevice *dup_out) {
   spdlog::info("STATE -> MERGE_RUNS_{0}: Merge sorted runs on the {0} device "
                "with Graceful Degradation",
                dev.hd_out->name);
-  static Record_t *_prev_record = nullptr;
-  if (dup_remove && _prev_record == nullptr) {
-    _prev_record = new Record_t;
-  }
-  if (dup_remove) {
-    _prev_record->fill();
-  }
 
-  RowCount const mem_run_size = run_info.run_size;
-  RowCount const n_runs = run_info.n_runs + n_runs_ssd;
-  RowCount const ssd_run_size = run_info.run_size / 2;
-
-  // make space for the ssd runs
-  for (uint32_t i = 0; i < n_runs_ssd; ++i) {
-    char *exchange = records[i * mem_run_size + ssd_run_size];
-    dev.hd_in->eappend(exchange, ssd_run_size * Record_t::bytes);
-    dev.hd_in->eread(exchange, ssd_run_size * Record_t::bytes,
-                     (i * mem_run_size) * Record_t::bytes);
-  } // for
-
-  Level level(ceil(log2(n_runs)));
-  uint64_t capacity = 1 << level;
-  auto end = index.begin() + capacity;
-  if (end > index.end()) {
-    throw std::out_of_range("inmem_spill: index out of range");
-  } // if
-
-  auto get_record = [&records, &mem_run_size, &ssd_run_size,
-                     &n_runs_ssd](MergeInd const &mind) -> Record_t const & {
-    if (mind.run_id < 2 * n_runs_ssd) {
-      return records[mind.run_id * ssd_run_size +
-                     mind.record_id % ssd_run_size];
-    } else {
-      return records[2 * n_runs_ssd * ssd_run_size +
-                     (mind.run_id - 2 * n_runs_ssd) * mem_run_size +
-                     mind.record_id];
-    }
-  };
-
-  auto cmp = [&n_runs, &get_record](MergeInd const &a, MergeInd const &b) {
-    if (a.run_id >= n_runs) {
-      return false;
-    } else if (b.run_id >= n_runs) {
-      return true;
-    }
-    return get_record(a) < get_record(b);
-  };
-
-  LoserTree ltree(level, cmp, index);
-  for (uint32_t i = 0; i < capacity; ++i) {
-    ltree.insert(i, 0);
-  }
-
-  std::size_t out_ind = 0;
-  RowCount dupRecordCount = 0;
-
-  while (!ltree.empty()) {
-    MergeInd popped = ltree.pop();
-    if (popped.run_id >= n_runs || get_record(popped).isfilled()) {
-      ltree.deleteRecordId(popped.run_id);
-      continue;
-    }
-    const Record_t &rec = get_record(popped);
-
-    if (dup_remove) {
-      if (*_prev_record != rec) {
-        if (dupRecordCount > 0) {
-          dup_out.append_only(*_prev_record, Record_t::bytes);
-          dup_out.append_only(reinterpret_cast<char *>(&dupRecordCount),
-                              sizeof(dupRecordCount));
-          dupRecordCount = 0;
-        }
-        *_prev_record = rec;
-        out.out[out_ind++] = *_prev_record;
-      } else {
-        ++dupRecordCount;
-      }
-    } else {
-      out.out[out_ind++] = rec;
-    }
-
-    ++popped.record_id;
-    if (popped.run_id < 2 * n_runs_ssd &&
-        popped.record_id % ssd_run_size == 0) {
-      uint64_t offset =
-          popped.run_id % 2
-              ? ((popped.run_id / 2) * mem_run_size) + ssd_run_size
-              : mem_run_size * n_runs_ssd +
-                    ((popped.run_id / 2) * ssd_run_size);
-      offset *= Record_t::bytes;
-      dev.hd_in->eread(
-          reinterpret_cast<char *>(&records[popped.run_id * ssd_run_size]),
-          Record_t::bytes * ssd_run_size, offset);
-    }
-
-    if (popped.record_id < mem_run_size) {
-      ltree.insert(popped.run_id, popped.record_id);
-    } else {
-      ltree.deleteRecordId(popped.run_id);
-    }
-    // delete &popped;
-    if (out_ind == out.out_size) {
-      // TODO: check return value
-      dev.hd_out->eappend(reinterpret_cast<char *>(out.out.data()),
-                          out.out_size * Record_t::bytes);
-      out_ind = 0;
-    } // if
-  }
-
-  if (dupRecordCount > 0) {
-    dup_out.append_only(*_prev_record, Record_t::bytes);
-    dup_out.append_only(reinterpret_cast<char *>(&dupRecordCount),
-                        sizeof(dupRecordCount));
-    dupRecordCount = 0;
-  }
-
-  if (out_ind > 0) {
-    // TODO: check return value
-    dev.hd_out->eappend(reinterpret_cast<char *>(out.out.data()),
-                        out_ind * Record_t::bytes);
-  }
+  SpillMemSource source(records, dev.hd_in, run_info.run_size,
+                        run_info.n_runs, n_runs_ssd);
+  source.open();
+  DeviceSink sink(out, dev.hd_out);
+  kway_merge(source, sink, index, dup_out);
 } // inmem_spill_merge
 
 void external_merge(RecordArr_t &records, OutBuffer out, DeviceInOut dev,
-                    Index_r &index, ExRunInfo run_info, bool dup_remove,
+                    Index_r &index, ExRunInfo run_info, WriteDevice *dup_out,
                     bool no_fill) {
   spdlog::info("STATE -> MERGE_RUNS_{0}: Merge sorted runs on the {0} device",
                dev.hd_out->name);
-  static Record_t *_prev_record = nullptr;
-  if (dup_remove && _prev_record == nullptr) {
-    _prev_record = new Record_t;
-  }
-  if (dup_remove) {
-    _prev_record->fill();
-  }
-
-  RowCount const run_size = run_info.run_size;
-  RowCount const n_runs = run_info.n_runs;
-
-  // int count = 0;
-  for (uint32_t run_id = 0; run_id < n_runs; ++run_id) { // n_runs in sdd: 8
-    dev.hd_in->eread(
-        reinterpret_cast<char *>((records + run_size * run_id).data()),
-        run_size * Record_t::bytes,
-        (run_info.exrun_size * run_id) * Record_t::bytes);
-  } // for
-
-  Level level(ceil(log2(n_runs)));
-  uint64_t capacity = 1 << level;
-  auto end = index.begin() + capacity;
-  if (end > index.end()) {
-    throw std::out_of_range("external_merge: index out of range");
-  } // if
 
-  auto get_record = [&records, &run_size](MergeInd const &mind) -> Record_t & {
-    return records[mind.run_id * run_size + mind.record_id % run_size];
+  auto merge = [&](auto &source) {
+    for (uint32_t run_id = 0; run_id < run_info.n_runs; ++run_id) {
+      source.add(dev.hd_in, run_info.exrun_size * run_id);
+    } // for
+    source.open();
+    DeviceSink sink(out, dev.hd_out);
+    return kway_merge(source, sink, index, dup_out);
   };
 
-  auto cmp = [&get_record, &n_runs](MergeInd const &a, MergeInd const &b) {
-    if (a.run_id >= n_runs) {
-      return false;
-    } else if (b.run_id >= n_runs) {
-      return true;
-    }
-    return get_record(a) < get_record(b);
-  };
-
-  LoserTree ltree(level, cmp, index);
-  for (uint32_t i = 0; i < capacity; ++i) {
-    ltree.insert(i, 0);
+  RowCount total;
+  RowCount const page = prefetch_page(run_info.run_size);
+  if (page > 0) {
+    // two pages per run, read ahead
+    PrefetchRunSource source(records, page, run_info.exrun_size);
+    total = merge(source);
+  } else {
+    PagedRunSource source(records, run_info.run_size, run_info.exrun_size);
+    total = merge(source);
   }
 
-  std::size_t out_ind = 0;
-  RowCount total = 0;
-  RowCount dupRecordCount = 0;
-
-  while (!ltree.empty()) {
-    MergeInd popped = ltree.pop();
-
-    if (popped.run_id >= n_runs || get_record(popped).isfilled()) {
-      ltree.deleteRecordId(popped.run_id);
-      continue;
-    }
-    const Record_t &rec = get_record(popped);
-
-    if (dup_remove) {
-      if (*_prev_record != rec) {
-        if (dupRecordCount > 0) {
-          dup_out.append_only(*_prev_record, Record_t::bytes);
-          dup_out.append_only(reinterpret_cast<char *>(&dupRecordCount),
-                              sizeof(dupRecordCount));
-          dupRecordCount = 0;
-        }
-        *_prev_record = rec;
-        out.out[out_ind++] = rec;
-        ++total;
-      } else {
-        ++dupRecordCount;
-      }
-    } else {
-      out.out[out_ind++] = rec;
-      ++total;
-    }
-
-    ++popped.record_id;
-    if (popped.record_id % run_size == 0) {
-      RowCount maxToBeRead = run_size;
-      if (popped.record_id + run_size > run_info.exrun_size) {
-        maxToBeRead = run_info.exrun_size - popped.record_id;
-      }
-      dev.hd_in->eread(
-          reinterpret_cast<char *>((records + run_size * popped.run_id).data()),
-          maxToBeRead * Record_t::bytes,
-          (run_info.exrun_size * popped.run_id + popped.record_id) *
-              Record_t::bytes);
-    } // if
-    if (popped.record_id < run_info.exrun_size) {
-      ltree.insert(popped.run_id, popped.record_id);
-    } else {
-      ltree.deleteRecordId(popped.run_id);
-    }
-    if (out_ind == out.out_size) {
-      // TODO: check return value
-      dev.hd_out->eappend(reinterpret_cast<char *>(out.out.data()),
-                          out.out_size * Record_t::bytes);
-      out_ind = 0;
-    } // if
-  }
-
-  if (dupRecordCount > 0) {
-    dup_out.append_only(*_prev_record, Record_t::bytes);
-    dup_out.append_only(reinterpret_cast<char *>(&dupRecordCount),
-                        sizeof(dupRecordCount));
-    dupRecordCount = 0;
-  }
-
-  if (out_ind > 0) {
-    // TODO: check return value
-    dev.hd_out->eappend(reinterpret_cast<char *>(out.out.data()),
-                        out_ind * Record_t::bytes);
-  }
-
-  RowCount merge_size = n_runs * run_info.exrun_size;
+  RowCount merge_size = run_info.n_runs * run_info.exrun_size;
   if (total < merge_size && !no_fill) {
     fill_run(dev.hd_out, out.out, merge_size - total);
   }
 } // external_merge
 
-void external_spill_merge(RecordArr_t &records, OutBuffer out, DeviceInOut dev,
-                          Device *dev_exin, Index_r &index, ExRunInfo run_info,
-                          RowCount const n_runs_hdd, bool dup_remove) {
-  spdlog::info("STATE -> MERGE_RUNS_{0}: Merge sorted runs on the {0} device "
-               "with Graceful Degradation",
-               dev.hd_out->name);
-  static Record_t *_prev_record = nullptr;
-  if (dup_remove && _prev_record == nullptr) {
-    _prev_record = new Record_t;
-  }
-  if (dup_remove) {
-    _prev_record->fill();
+void parallel_external_merge(RecordArr_t &records, OutBuffer out,
+                             DeviceInOut dev, Index_r &index,
+                             ExRunInfo run_info, RowCount const n_records,
+                             std::size_t const n_threads) {
+  RowCount const n_runs = run_info.n_runs;
+  RowCount const exrun_size = run_info.exrun_size;
+  // every partition gets a slice of the merge index as big as a whole merge
+  // and two pages per run no shorter than minm_nrecords()
+  RowCount const part_capacity = RowCount(1) << Level(ceil(log2(n_runs)));
+  RowCount const n_parts = std::min<RowCount>(
+      {n_threads, index.size() / part_capacity,
+       run_info.run_size / (2 * std::max<std::size_t>(1, minm_nrecords()))});
+  // and its share of the run pages and the output buffer
+  RowCount const page_size =
+      n_parts > 1 ? prefetch_page(run_info.run_size / n_parts) : 0;
+  RowCount const out_size = n_parts > 1 ? out.out_size / n_parts : 0;
+  if (n_parts < 2 || page_size == 0 || out_size == 0 ||
+      records.size() < n_runs * (n_parts - 1)) {
+    external_merge(records, out, dev, index, run_info, nullptr, true);
+    return;
   }
 
-  RowCount const run_size = run_info.run_size;
-  RowCount const n_runs = run_info.n_runs + n_runs_hdd;
+  spdlog::info("STATE -> MERGE_RUNS_{0}: Merge sorted runs on the {0} device "
+               "in {1} partitions",
+               dev.hd_out->name, n_parts);
 
-  // int count = 0;
-  for (uint32_t run_id = 0; run_id < run_info.n_runs;
-       ++run_id) { // n_runs in sdd: 8
-    dev.hd_in->eread(
-        reinterpret_cast<char *>((records + run_size * run_id).data()),
-        run_size * Record_t::bytes,
-        (run_info.exrun_size * run_id) * Record_t::bytes);
+  // all runs are full but the last one
+  std::vector<RowCount> size(n_runs);
+  for (RunId run = 0; run < n_runs; ++run) {
+    size[run] = std::min(exrun_size, n_records - run * exrun_size);
   } // for
-  for (uint32_t run_id = run_info.n_runs; run_id < n_runs; ++run_id) {
-    dev_exin->eread(
-        reinterpret_cast<char *>((records + run_size * run_id).data()),
-        run_size * Record_t::bytes,
-        (run_info.exrun_size * (run_id - run_info.n_runs)) * Record_t::bytes);
-  }
-
-  Level level(ceil(log2(n_runs)));
-  uint64_t capacity = 1 << level;
-  auto end = index.begin() + capacity;
-  if (end > index.end()) {
-    throw std::out_of_range("external_merge: index out of range");
-  } // if
-
-  auto get_record = [&records, &run_size](MergeInd const &mind) -> Record_t & {
-    return records[mind.run_id * run_size + mind.record_id % run_size];
-  };
-
-  auto cmp = [&get_record, &n_runs](MergeInd const &a, MergeInd const &b) {
-    if (a.run_id >= n_runs) {
-      return false;
-    } else if (b.run_id >= n_runs) {
-      return true;
-    }
-    return get_record(a) < get_record(b);
-  };
-
-  LoserTree ltree(level, cmp, index);
-  for (uint32_t i = 0; i < capacity; ++i) {
-    ltree.insert(i, 0);
-  }
 
-  std::size_t out_ind = 0;
-  RowCount dupRecordCount = 0;
-
-  while (!ltree.empty()) {
-    MergeInd popped = ltree.pop();
+  // sample every run at evenly spaced positions, close enough that the
+  // records between two samples fit a co-ranking page of the work area
+  constexpr RowCount kSamples = 32;
+  RowCount const rank_page = records.size() / (n_runs * (n_parts - 1));
+  RowCount const n_samples =
+      std::max<RowCount>(kSamples, (exrun_size + rank_page - 1) / rank_page);
+  RecordArr_t samples(n_runs * n_samples);
+  std::vector<RowCount> sample_pos(n_runs * n_samples);
+  std::vector<std::future<::ssize_t>> reads;
+  for (RunId run = 0; run < n_runs; ++run) {
+    for (RowCount j = 0; j < n_samples; ++j) {
+      RowCount const pos = size[run] * j / n_samples;
+      sample_pos[run * n_samples + j] = pos;
+      reads.push_back(dev.hd_in->async_eread(
+          samples[run * n_samples + j], Record_t::bytes,
+          (run * exrun_size + pos) * Record_t::bytes));
+    } // for
+  } // for
+  for (auto &read : reads) {
+    read.get();
+  } // for
+  reads.clear();
+
+  // splitters are quantiles of the pooled samples
+  std::vector<RowCount> pooled(n_runs * n_samples);
+  std::iota(pooled.begin(), pooled.end(), 0);
+  std::sort(pooled.begin(), pooled.end(),
+            [&samples](RowCount const a, RowCount const b) {
+              return samples[a] < samples[b];
+            });
+
+  // rank[p][run]: first record of the run in partition p; records equal to
+  // a splitter go to the partition it starts. The bound lies between the
+  // run's samples around the splitter, those records are read in one request
+  // into the work area, which the merge has not taken yet, and searched there.
+  std::vector<std::vector<RowCount>> rank(n_parts + 1,
+                                          std::vector<RowCount>(n_runs, 0));
+  rank[n_parts] = size;
+  std::vector<RowCount> page_end((n_parts - 1) * n_runs); // rank[p] page ends
+  for (RowCount p = 1; p < n_parts; ++p) {
+    Record_t const &key = samples[pooled[p * pooled.size() / n_parts]];
+    for (RunId run = 0; run < n_runs; ++run) {
+      RowCount j = 0;
+      while (j < n_samples && samples[run * n_samples + j] < key) {
+        ++j;
+      } // while
+      RowCount const lo = j == 0 ? 0 : sample_pos[run * n_samples + j - 1] + 1;
+      RowCount const hi =
+          j == n_samples ? size[run] : sample_pos[run * n_samples + j];
+      rank[p][run] = lo;
+      page_end[(p - 1) * n_runs + run] = hi;
+      if (hi > lo) {
+        reads.push_back(dev.hd_in->async_eread(
+            records[((p - 1) * n_runs + run) * rank_page],
+            (hi - lo) * Record_t::bytes,
+            (run * exrun_size + lo) * Record_t::bytes));
+      }
+    } // for
+  } // for
+  for (auto &read : reads) {
+    read.get();
+  } // for
+  RecordView_t const work = records.view();
+  for (RowCount p = 1; p < n_parts; ++p) {
+    Record_t const &key = samples[pooled[p * pooled.size() / n_parts]];
+    for (RunId run = 0; run < n_runs; ++run) {
+      RowCount const lo = rank[p][run];
+      RowCount const hi = page_end[(p - 1) * n_runs + run];
+      auto const page = work.begin() + ((p - 1) * n_runs + run) * rank_page;
+      rank[p][run] =
+          lo + (std::lower_bound(page, page + (hi - lo), key) - page);
+    } // for
+  } // for
 
-    if (popped.run_id >= n_runs || get_record(popped).isfilled()) {
-      ltree.deleteRecordId(popped.run_id);
+  // each partition is merged on its own into its place in the output
+  std::size_t base = dev.hd_out->get_pos() - dev.hd_out->get_base();
+  ThreadPool pool(n_parts);
+  std::vector<std::future<void>> merging;
+  for (RowCount p = 0; p < n_parts; ++p) {
+    RowCount part_records = 0;
+    for (RunId run = 0; run < n_runs; ++run) {
+      part_records += rank[p + 1][run] - rank[p][run];
+    } // for
+    if (part_records == 0) {
       continue;
     }
-    const Record_t &rec = get_record(popped);
-
-    if (dup_remove) {
-      if (*_prev_record != rec) {
-        if (dupRecordCount > 0) {
-          dup_out.append_only(*_prev_record, Record_t::bytes);
-          dup_out.append_only(reinterpret_cast<char *>(&dupRecordCount),
-                              sizeof(dupRecordCount));
-          dupRecordCount = 0;
+
+    merging.push_back(pool.submit([&, p, base] {
+      RecordArr_t pages = records + p * 2 * n_runs * page_size;
+      RecordArr_t part_out = out.out + p * out_size;
+      PrefetchRunSource source(pages, page_size, exrun_size);
+      for (RunId run = 0; run < n_runs; ++run) {
+        RowCount const segment = rank[p + 1][run] - rank[p][run];
+        if (segment > 0) {
+          source.add(dev.hd_in, run * exrun_size + rank[p][run], segment);
         }
-        *_prev_record = rec;
-        out.out[out_ind++] = rec;
-      } else {
-        ++dupRecordCount;
-      }
-    } else {
-      out.out[out_ind++] = rec;
-    }
+      } // for
+      source.open();
+
+      Index_r part_index(
+          std::shared_ptr<MergeInd>(index.ptr(),
+                                    index.data() + p * part_capacity),
+          part_capacity);
+      DeviceSink sink({out_size, part_out, out.n_bufs}, dev.hd_out, base);
+      kway_merge(source, sink, part_index, nullptr);
+    }));
+    base += part_records * Record_t::bytes;
+  } // for
+  for (auto &merge : merging) {
+    merge.get();
+  } // for
+} // parallel_external_merge
+
+/**
+ * @brief Merge \p runs into one run written to the end of \p hd
+ *
+ * @return RowCount number of records written
+ */
+static RowCount merge_group(RecordArr_t &records, OutBuffer out,
+                            std::vector<RunDesc> const &runs, Device *hd,
+                            Index_r &index, WriteDevice *dup_out) {
+  auto merge = [&](auto &source) {
+    for (RunDesc const &run : runs) {
+      source.add(run.dev, run.offset, run.size);
+    } // for
+    source.open();
+    DeviceSink sink(out, hd);
+    return kway_merge(source, sink, index, dup_out);
+  };
 
-    ++popped.record_id;
-    if (popped.record_id % run_size == 0) {
-      RowCount maxToBeRead = run_size;
-      if (popped.record_id + run_size > run_info.exrun_size) {
-        maxToBeRead = run_info.exrun_size - popped.record_id;
-      }
-      if (popped.run_id < run_info.n_runs) {
-        dev.hd_in->eread(
-            reinterpret_cast<char *>(
-                (records + run_size * popped.run_id).data()),
-            maxToBeRead * Record_t::bytes,
-            (run_info.exrun_size * popped.run_id + popped.record_id) *
-                Record_t::bytes);
-      } else {
-        dev_exin->eread(
-            reinterpret_cast<char *>(
-                (records + run_size * popped.run_id).data()),
-            maxToBeRead * Record_t::bytes,
-            (run_info.exrun_size * (popped.run_id - run_info.n_runs) +
-             popped.record_id) *
-                Record_t::bytes);
-      }
-    }
-    // if
-    if (popped.record_id < run_info.exrun_size) {
-      ltree.insert(popped.run_id, popped.record_id);
-    } else {
-      ltree.deleteRecordId(popped.run_id);
+  RowCount const page = prefetch_page(records.size() / runs.size());
+  if (page > 0) {
+    PrefetchRunSource source(records, page, 0);
+    return merge(source);
+  }
+  PagedRunSource source(records, records.size() / runs.size(), 0);
+  return merge(source);
+} // merge_group
+
+void planned_merge(RecordArr_t &records, OutBuffer out,
+                   std::vector<RunDesc> runs, MergePlan const &plan,
+                   Device *hd_tmp, Device *hd_out, Index_r &index,
+                   WriteDevice *dup_out) {
+  auto const start = std::chrono::steady_clock::now();
+  for (std::size_t s = 0; s < plan.steps.size(); ++s) {
+    std::vector<RunDesc> group;
+    for (std::size_t const run : plan.steps[s].inputs) {
+      group.push_back(runs[run]);
+    } // for
+    if (s + 1 == plan.steps.size()) {
+      spdlog::info("STATE -> MERGE_RUNS_{0}: Merge sorted runs on the {0} "
+                   "device",
+                   hd_out->name);
+      merge_group(records, out, group, hd_out, index, dup_out);
+      break;
     }
-    if (out_ind == out.out_size) {
-      // TODO: check return value
-      dev.hd_out->eappend(reinterpret_cast<char *>(out.out.data()),
-                          out.out_size * Record_t::bytes);
-      out_ind = 0;
-    } // if
+    spdlog::info("STATE -> MERGE_RUNS_{0}: Merge {1} sorted runs on the {0} "
+                 "device",
+                 hd_tmp->name, group.size());
+    RowCount const offset =
+        (hd_tmp->get_pos() - hd_tmp->get_base()) / Record_t::bytes;
+    RowCount const size =
+        merge_group(records, out, group, hd_tmp, index, dup_out);
+    runs.push_back({hd_tmp, offset, size});
+  } // for
+  log_planned_merge(plan, start);
+} // planned_merge
+
+void log_planned_merge(MergePlan const &plan,
+                       std::chrono::steady_clock::time_point const start) {
+  double const elapsed = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  spdlog::info("STATE -> PLAN_MERGE: {} merges took {:.0f} ms, predicted "
+               "{:.0f} ms",
+               plan.steps.size(), elapsed, plan.cost);
+} // log_planned_merge
+
+void runs_merge(RecordArr_t &records, OutBuffer out, std::vector<RunDesc> runs,
+                Device *hd_tmp, Device *hd_out, Index_r &index,
+                WriteDevice *dup_out) {
+  if (runs.empty()) {
+    return;
   }
+  MergePlanner const planner(records.size(), out.out_size, index.size(),
+                             hd_tmp, hd_out, minm_nrecords());
+  MergePlan const plan = planner.plan(runs);
+  planned_merge(records, out, std::move(runs), plan, hd_tmp, hd_out, index,
+                dup_out);
+} // runs_merge
 
-  if (dupRecordCount > 0) {
-    dup_out.append_only(*_prev_record, Record_t::bytes);
-    dup_out.append_only(reinterpret_cast<char *>(&dupRecordCount),
-                        sizeof(dupRecordCount));
-    dupRecordCount = 0;
-  }
+void external_spill_merge(RecordArr_t &records, OutBuffer out, DeviceInOut dev,
+                          Device *dev_exin, Index_r &index, ExRunInfo run_info,
+                          RowCount const n_runs_hdd, WriteDevice *dup_out) {
+  spdlog::info("STATE -> MERGE_RUNS_{0}: Merge sorted runs on the {0} device "
+               "with Graceful Degradation",
+               dev.hd_out->name);
+
+  auto merge = [&](auto &source) {
+    for (uint32_t run_id = 0; run_id < run_info.n_runs; ++run_id) {
+      source.add(dev.hd_in, run_info.exrun_size * run_id);
+    } // for
+    for (uint32_t run_id = 0; run_id < n_runs_hdd; ++run_id) {
+      source.add(dev_exin, run_info.exrun_size * run_id);
+    } // for
+    source.open();
+    DeviceSink sink(out, dev.hd_out);
+    kway_merge(source, sink, index, dup_out);
+  };
 
-  if (out_ind > 0) {
-    // TODO: check return value
-    dev.hd_out->eappend(reinterpret_cast<char *>(out.out.data()),
-                        out_ind * Record_t::bytes);
+  RowCount const page = prefetch_page(run_info.run_size);
+  if (page > 0) {
+    // two pages per run, read ahead
+    PrefetchRunSource source(records, page, run_info.exrun_size);
+    merge(source);
+  } else {
+    PagedRunSource source(records, run_info.run_size, run_info.exrun_size);
+    merge(source);
   }
 } // external_spill_merge
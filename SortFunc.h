@@ -3,6 +3,8 @@
 #include "Device.h"
 #include "Iterator.h"
 #include "Record.h"
+#include <chrono>
+#include <vector>
 
 struct RunInfo {
   RowCount const run_size; // number of records in a run
@@ -12,6 +14,7 @@ struct RunInfo {
 struct OutBuffer {
   RowCount out_size; // number of records in the output
   RecordArr_t &out;
+  RowCount n_bufs = 2; // ring of out_size / n_bufs records, written behind
 };
 
 struct DeviceInOut {
@@ -23,27 +26,99 @@ struct ExRunInfo : RunInfo {
   RowCount const exrun_size; // number of records in a device run
 };
 
-void incache_sort(RecordArr_t &records, Index_t &index,
-                  RowCount const n_records);
+struct RunDesc {
+  Device *dev;
+  RowCount offset; // first record of the run on the device
+  RowCount size;   // number of records in the run
+};
 
-void incache_sort(RecordArr_t const &records, RecordArr_t &out, Index_t &index,
+// The in-cache sorts take an Index_t for runs of up to UINT16_MAX records
+// and an Index_w beyond.
+
+template <class Ind>
+void incache_sort(RecordArr_t &records, Index<Ind> &index,
                   RowCount const n_records);
 
+template <class Ind>
+void incache_sort(RecordArr_t const &records, RecordArr_t &out,
+                  Index<Ind> &index, RowCount const n_records);
+
+template <class Ind>
+void incache_radix_sort(RecordArr_t &records, Index<Ind> &index,
+                        RowCount const n_records);
+
+template <class Ind>
+void incache_radix_sort(RecordArr_t const &records, RecordArr_t &out,
+                        Index<Ind> &index, RowCount const n_records);
+
+void incache_prefix_sort(RecordArr_t const &records, RecordArr_t &out,
+                         Index_p &prefix, RowCount const n_records);
+
+// The merges write a repeated record once and append it with its count to
+// dup_out; with a null dup_out they keep duplicates.
+
 void inmem_merge(RecordArr_t const &records, OutBuffer out, Device *hd,
-                 Index_r &index, RunInfo run_info, bool dup_remove,
+                 Index_r &index, RunInfo run_info, WriteDevice *dup_out,
                  bool no_fill = false);
 
 void inmem_spill_merge(RecordArr_t &records, OutBuffer out, DeviceInOut dev,
                        Index_r &index, RunInfo run_info,
-                       RowCount const n_runs_ssd, bool dup_remove);
+                       RowCount const n_runs_ssd, WriteDevice *dup_out);
 
 void external_merge(RecordArr_t &records, OutBuffer out, DeviceInOut dev,
-                    Index_r &index, ExRunInfo run_info, bool dup_remove,
+                    Index_r &index, ExRunInfo run_info, WriteDevice *dup_out,
                     bool no_fill = false);
 
+/**
+ * @brief Final external merge split into \p n_threads key ranges
+ *
+ * Splitter keys are quantiles of samples read from every run in one batch of
+ * asynchronous reads. Each splitter is co-ranked in every run: the records
+ * between the run's samples around it are read into a page of the work area
+ * and searched there. Each key range is merged on its own thread and written
+ * at its precomputed offset of the output device. The runs hold
+ * \p n_records records in total, every run is full but the last one; no
+ * duplicate removal, no fill.
+ */
+void parallel_external_merge(RecordArr_t &records, OutBuffer out,
+                             DeviceInOut dev, Index_r &index,
+                             ExRunInfo run_info, RowCount const n_records,
+                             std::size_t const n_threads);
+
 void external_spill_merge(RecordArr_t &records, OutBuffer out, DeviceInOut dev,
                           Device *dev_exin, Index_r &index, ExRunInfo run_info,
-                          RowCount const n_runs_hdd, bool dup_remove);
+                          RowCount const n_runs_hdd, WriteDevice *dup_out);
+
+struct MergePlan;
+
+/**
+ * @brief Merge \p runs along the steps of \p plan
+ *
+ * Every step but the last appends its run to \p hd_tmp, the last one writes
+ * to \p hd_out. The merge time is logged next to the predicted one.
+ */
+void planned_merge(RecordArr_t &records, OutBuffer out,
+                   std::vector<RunDesc> runs, MergePlan const &plan,
+                   Device *hd_tmp, Device *hd_out, Index_r &index,
+                   WriteDevice *dup_out);
+
+/**
+ * @brief Log the time of the merges of \p plan, begun at \p start, next to
+ * the predicted one
+ *
+ */
+void log_planned_merge(MergePlan const &plan,
+                       std::chrono::steady_clock::time_point const start);
+
+/**
+ * @brief Merge variable-length device runs into \p hd_out
+ *
+ * The merge tree is the cheapest one of MergePlanner for pages carved from
+ * \p records.
+ */
+void runs_merge(RecordArr_t &records, OutBuffer out, std::vector<RunDesc> runs,
+                Device *hd_tmp, Device *hd_out, Index_r &index,
+                WriteDevice *dup_out);
 
 inline void fill_run(Device *dev, RecordArr_t &out,
                      std::size_t const fill_records) {
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Bounded lock-free queue of one producer and one consumer thread.
+ *
+ * The slots are a ring of a power of two entries. The producer only writes
+ * the tail, the consumer only the head; each publishes its slot with a
+ * release store the other side picks up with an acquire load, so a popped
+ * entry and everything written before its push are visible to the consumer.
+ * A blocking push or pop spins briefly, then sleeps on a condition variable
+ * until the other side moves or wake() is called.
+ */
+template <typename T> class SpscQueue {
+private:
+  std::vector<T> _slots;
+  std::size_t const _mask;
+  alignas(64) std::atomic<std::size_t> _head{0}; // next entry to pop
+  alignas(64) std::atomic<std::size_t> _tail{0}; // next entry to push
+  std::atomic<int> _waiters{0}; // threads asleep on _moved
+  std::mutex _mutex;
+  std::condition_variable _moved;
+
+  static constexpr int kSpins = 64; // tries before a blocking call sleeps
+
+  static std::size_t round_up(std::size_t const capacity) {
+    std::size_t size = 1;
+    while (size < capacity) {
+      size *= 2;
+    } // while
+    return size;
+  }
+
+  bool push_slot(T const &entry) {
+    std::size_t const tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head.load(std::memory_order_acquire) == _slots.size()) {
+      return false; // full
+    }
+    _slots[tail & _mask] = entry;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop_slot(T &entry) {
+    std::size_t const head = _head.load(std::memory_order_relaxed);
+    if (head == _tail.load(std::memory_order_acquire)) {
+      return false; // empty
+    }
+    entry = _slots[head & _mask];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Wake a side asleep on the entry just pushed or popped
+   *
+   * The fence orders the head or tail store before the load of _waiters;
+   * wait_until() orders its increment before loading the head and tail, so
+   * either the sleeper sees the move or the mover sees the sleeper.
+   */
+  void notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_waiters.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<std::mutex> const lock(_mutex);
+      _moved.notify_one();
+    }
+  }
+
+  template <typename Try>
+  bool wait_until(Try const &done, std::atomic<bool> const &stop) {
+    for (int i = 0; i < kSpins; ++i) {
+      if (done()) {
+        return true;
+      }
+      if (stop.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      std::this_thread::yield();
+    } // for
+    std::unique_lock<std::mutex> lock(_mutex);
+    _waiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool moved = false;
+    _moved.wait(lock, [&] {
+      return (moved = done()) || stop.load(std::memory_order_relaxed);
+    });
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+    return moved;
+  }
+
+public:
+  /**
+   * @brief Construct a new SpscQueue object
+   *
+   * @param capacity most entries queued, rounded up to a power of two
+   */
+  explicit SpscQueue(std::size_t const capacity)
+      : _slots(round_up(capacity)), _mask(_slots.size() - 1) {}
+
+  SpscQueue(SpscQueue const &) = delete;
+  SpscQueue &operator=(SpscQueue const &) = delete;
+
+  bool try_push(T const &entry) {
+    if (!push_slot(entry)) {
+      return false; // full
+    }
+    notify();
+    return true;
+  }
+
+  bool try_pop(T &entry) {
+    if (!pop_slot(entry)) {
+      return false; // empty
+    }
+    notify();
+    return true;
+  }
+
+  /**
+   * @brief Push \p entry, sleeping while the queue is full
+   *
+   * @return false if \p stop was raised first
+   */
+  bool push(T const &entry, std::atomic<bool> const &stop) {
+    if (!wait_until([&] { return push_slot(entry); }, stop)) {
+      return false;
+    }
+    notify();
+    return true;
+  }
+
+  /**
+   * @brief Pop into \p entry, sleeping while the queue is empty
+   *
+   * @return false if \p stop was raised first
+   */
+  bool pop(T &entry, std::atomic<bool> const &stop) {
+    if (!wait_until([&] { return pop_slot(entry); }, stop)) {
+      return false;
+    }
+    notify();
+    return true;
+  }
+
+  /**
+   * @brief Wake a blocked push or pop to look at its stop flag again
+   *
+   */
+  void wake() {
+    std::lock_guard<std::mutex> const lock(_mutex);
+    _moved.notify_all();
+  }
+}; // class SpscQueue
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Fixed set of worker threads running submitted tasks in order.
+ *
+ * Tasks are picked up by the first idle worker; the returned future becomes
+ * ready once the task is done and carries its exception, if any.
+ */
+class ThreadPool {
+private:
+  std::mutex _lock;
+  std::condition_variable _ready;
+  std::deque<std::packaged_task<void()>> _tasks;
+  std::vector<std::thread> _workers;
+  bool _stopped = false;
+
+  void serve() {
+    for (;;) {
+      std::packaged_task<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(_lock);
+        _ready.wait(lock, [this] { return _stopped || !_tasks.empty(); });
+        if (_tasks.empty()) {
+          return; // stopped and drained
+        }
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      }
+      task();
+    } // for
+  }
+
+public:
+  /**
+   * @brief Construct a new ThreadPool object
+   *
+   * @param n_threads number of workers, at least one
+   */
+  explicit ThreadPool(std::size_t const n_threads) {
+    for (std::size_t i = 0; i < (n_threads > 0 ? n_threads : 1); ++i) {
+      _workers.emplace_back(&ThreadPool::serve, this);
+    } // for
+  }
+
+  ThreadPool(ThreadPool const &) = delete;
+  ThreadPool &operator=(ThreadPool const &) = delete;
+
+  std::future<void> submit(std::function<void()> fn) {
+    std::packaged_task<void()> task(std::move(fn));
+    std::future<void> done = task.get_future();
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _tasks.push_back(std::move(task));
+    }
+    _ready.notify_one();
+    return done;
+  }
+
+  std::size_t size() const { return _workers.size(); }
+
+  /**
+   * @brief Run the queued tasks, then join the workers
+   *
+   */
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _stopped = true;
+    }
+    _ready.notify_all();
+    for (auto &worker : _workers) {
+      worker.join();
+    } // for
+  }
+}; // class ThreadPool
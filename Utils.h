@@ -1,39 +1,157 @@
 #pragma once
 
+#include "Config.h"
 #include "Consts.h"
 #include "Record.h"
+#include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
 static inline std::size_t cache_nruns() { return 1; } // cache_nruns
 
 static inline std::size_t fcache_nrecords() {
-  return kCacheSize / Record_t::bytes;
+  return Config::cache_size / Record_t::bytes;
 } // fcache_nrecords
 
+/**
+ * @brief Algorithm used to sort cache-sized mini runs.
+ *
+ */
+enum class SortMode {
+  Quick,  //!< std::sort on the record index
+  Radix,  //!< MSD radix sort on the leading key bytes
+  Prefix, //!< std::sort on (8-byte key prefix, index) pairs
+};
+
+inline SortMode sortMode() {
+  const char *mode = std::getenv("SORT_MODE");
+  if (mode == nullptr) {
+    return SortMode::Quick;
+  }
+  if (std::string(mode) == "radix") {
+    return SortMode::Radix;
+  }
+  if (std::string(mode) == "prefix") {
+    return SortMode::Prefix;
+  }
+  return SortMode::Quick;
+}
+
+/**
+ * @brief Number of threads sorting cache-sized mini runs
+ *
+ * SORT_THREADS, defaults to the number of hardware threads.
+ */
+inline std::size_t sortThreads() {
+  const char *threads = std::getenv("SORT_THREADS");
+  if (threads != nullptr && std::atoi(threads) > 0) {
+    return std::atoi(threads);
+  }
+  std::size_t const hardware = std::thread::hardware_concurrency();
+  return hardware > 0 ? hardware : 1;
+}
+
+/**
+ * @brief Bytes of a sort index entry of a cache run
+ *
+ * uint16_t unless the cache holds more than UINT16_MAX records with uint32_t
+ * entries, see CacheIndex.
+ */
+static inline std::size_t cache_index_bytes() {
+  return Config::cache_size / (Record_t::bytes + sizeof(uint32_t)) > UINT16_MAX
+             ? sizeof(uint32_t)
+             : sizeof(uint16_t);
+} // cache_index_bytes
+
+/**
+ * @brief Bytes behind each record of a cache run
+ *
+ * Its sort index entry, or in prefix mode its PrefixInd, which the sort index
+ * of the natural runs then shares.
+ */
+static inline std::size_t cache_entry_bytes() {
+  return sortMode() == SortMode::Prefix ? sizeof(PrefixInd)
+                                        : cache_index_bytes();
+} // cache_entry_bytes
+
 static inline std::size_t cache_nrecords() {
   // return 8; // for testing
-  std::size_t n_records = kCacheSize / (Record_t::bytes + sizeof(uint16_t));
+  std::size_t const entry = cache_entry_bytes();
+  // the entries follow the records, aligned to their size
+  std::size_t n_records =
+      (Config::cache_size - (entry - 1)) / (Record_t::bytes + entry);
+  n_records = std::min<std::size_t>(
+      n_records,
+      cache_index_bytes() == sizeof(uint16_t) ? UINT16_MAX : UINT32_MAX);
   return n_records - n_records % 2;
 } // cache_nrecords
 
+/**
+ * @brief Byte offset of the sort index behind the records of a cache run
+ *
+ */
+static inline std::size_t cache_index_offset() {
+  std::size_t const entry = cache_entry_bytes();
+  return (cache_nrecords() * Record_t::bytes + entry - 1) / entry * entry;
+} // cache_index_offset
+
+/**
+ * @brief Record storage of \p bytes bytes aligned to kIoAlign
+ *
+ * Suitable as a direct I/O buffer; released with std::free.
+ */
+static inline std::shared_ptr<Record_t> aligned_records(std::size_t bytes) {
+  bytes = (bytes + kIoAlign - 1) / kIoAlign * kIoAlign;
+  void *ptr = std::aligned_alloc(kIoAlign, bytes);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return std::shared_ptr<Record_t>(reinterpret_cast<Record_t *>(ptr),
+                                   [](Record_t *rec) { std::free(rec); });
+} // aligned_records
+
 template <typename From, typename To>
 static inline std::shared_ptr<To> ptr_cast(std::shared_ptr<From> ptr) {
   return std::shared_ptr<To>(ptr, reinterpret_cast<To *>(ptr.get()));
 } // ptr_cast
 
 static inline std::size_t fmem_nrecords() {
-  return kMemSize / Record_t::bytes;
+  return Config::mem_size / Record_t::bytes;
 } // fmem_nrecords
 
 static inline std::size_t out_nrecords() {
   // return 16; // for testing
-  return kCacheSize / Record_t::bytes;
+  return Config::cache_size / Record_t::bytes;
 } // out_nrecords
 
+/**
+ * @brief Cache runs handed to the sort threads, carved from the memory
+ *
+ * Two per thread keep the threads busy while the scan fills the next one, up
+ * to a quarter of the memory behind the output buffer. None for one thread.
+ */
+static inline std::size_t sort_nworkers() {
+  std::size_t const n_threads = sortThreads();
+  if (n_threads < 2 || Config::mem_size <= Config::cache_size) {
+    return 0;
+  }
+  return std::min(2 * n_threads, (Config::mem_size - Config::cache_size) /
+                                     Config::cache_size / 4);
+} // sort_nworkers
+
 static inline std::size_t mmem_nrecords() {
   // return 32; // for testing
-  return (kMemSize - kCacheSize) / Record_t::bytes;
+  // the output buffer and the sort workers come first
+  return (Config::mem_size - (1 + sort_nworkers()) * Config::cache_size) /
+         Record_t::bytes;
 } // mmem_nrecords
 
 static inline std::size_t mem_nruns() {
@@ -46,7 +164,7 @@ static inline std::size_t mem_nrecords() {
 } // mem_nrecords
 
 static inline std::size_t fssd_nrecords() {
-  return kSSDSize / Record_t::bytes;
+  return Config::ssd_size / Record_t::bytes;
 } // fssd_nrecords
 
 static inline std::size_t ssd_nruns() {
@@ -60,10 +178,74 @@ static inline std::size_t ssd_nrecords() {
 
 static inline std::size_t minm_nrecords() {
   // return 4; // for testing
-  constexpr std::size_t min_size = 100 * 5 * 1024 * 1024 / 1000;
+  // bytes the HDD transfers during one access latency
+  std::size_t const min_size =
+      Config::hdd.latency * Config::hdd.bandwidth * 1024 * 1024 / 1000;
   return min_size / Record_t::bytes;
 } // minm_nrecords
 
+/**
+ * @brief Page of a run merged from \p run_records of memory with read-ahead
+ *
+ * @return two pages split the memory, 0 if such a page would be shorter than
+ * minm_nrecords() and the run is better read one full page at a time
+ */
+static inline std::size_t prefetch_page(std::size_t const run_records) {
+  std::size_t const page = run_records / 2;
+  return page > 0 && page >= minm_nrecords() ? page : 0;
+} // prefetch_page
+
+/**
+ * @brief Check that the memory hierarchy of Config can sort records of
+ * Record_t::bytes
+ *
+ * @throw std::invalid_argument naming the first violated constraint
+ */
+static inline void check_hierarchy() {
+  if (Config::cache_size % kIoAlign != 0) {
+    throw std::invalid_argument("cache_size must be a multiple of " +
+                                std::to_string(kIoAlign));
+  }
+  if (cache_nrecords() < 2) {
+    throw std::invalid_argument("cache_size must hold two records");
+  }
+  if (Config::mem_size <= Config::cache_size || mem_nruns() < 2) {
+    throw std::invalid_argument(
+        "mem_size must hold an output buffer and two cache runs");
+  }
+  if (ssd_nruns() < 2) {
+    throw std::invalid_argument("ssd_size must hold two memory runs");
+  }
+  if (Config::ssd.latency < 0 || Config::hdd.latency < 0 ||
+      Config::ssd.bandwidth <= 0 || Config::hdd.bandwidth <= 0) {
+    throw std::invalid_argument("device latency must not be negative and "
+                                "bandwidth must be positive");
+  }
+  if (mmem_nrecords() < 2 * minm_nrecords()) {
+    // the HDD merges read pages of at least minm_nrecords() per run
+    throw std::invalid_argument(
+        "mem_size must hold two HDD pages of latency * bandwidth bytes");
+  }
+  // the merges share a tree of losers index of one cache size
+  std::size_t const leaves = Config::cache_size / sizeof(MergeInd);
+  for (std::size_t const fan_in : {mem_nruns(), ssd_nruns()}) {
+    if ((std::size_t(1) << static_cast<int>(std::ceil(std::log2(fan_in)))) >
+        leaves) {
+      throw std::invalid_argument("cache_size is too small for the merge "
+                                  "fan-in of mem_size and ssd_size");
+    }
+  } // for
+} // check_hierarchy
+
+inline bool isDirectIo() {
+  const char *direct = std::getenv("DIRECT_IO");
+  if (direct == nullptr) {
+    return false;
+  }
+  int val = std::atoi(direct);
+  return val > 0;
+}
+
 inline bool isDistinct() {
   const char *distinct = std::getenv("DISTINCT");
   if (distinct == nullptr) {
@@ -72,3 +254,97 @@ inline bool isDistinct() {
   int val = std::atoi(distinct);
   return val > 0;
 }
+
+/**
+ * @brief Seed of the generated input
+ *
+ * SEED, defaults to a seed from the clock and the system entropy source.
+ */
+inline uint64_t scanSeed() {
+  const char *seed = std::getenv("SEED");
+  if (seed != nullptr) {
+    return std::strtoull(seed, nullptr, 0);
+  }
+  return (uint64_t(std::time(nullptr)) << 32) ^ std::random_device()();
+}
+
+/**
+ * @brief Number of threads generating the input
+ *
+ * GEN_THREADS, defaults to the number of hardware threads.
+ */
+inline std::size_t genThreads() {
+  const char *threads = std::getenv("GEN_THREADS");
+  if (threads != nullptr && std::atoi(threads) > 0) {
+    return std::atoi(threads);
+  }
+  std::size_t const hardware = std::thread::hardware_concurrency();
+  return hardware > 0 ? hardware : 1;
+}
+
+/**
+ * @brief Scan, sort and validation run on threads of their own
+ *
+ * PIPELINE, defaults to 1; PIPELINE=0 runs the whole plan on one thread.
+ */
+inline bool isPipelined() {
+  const char *pipeline = std::getenv("PIPELINE");
+  if (pipeline == nullptr) {
+    return true;
+  }
+  return std::atoi(pipeline) > 0;
+}
+
+/**
+ * @brief Number of threads checking chunks of the sorted output
+ *
+ * VALIDATE_THREADS, defaults to the number of hardware threads.
+ * VALIDATE_THREADS=1 checks the rows as they stream through the plan.
+ */
+inline std::size_t validateThreads() {
+  const char *threads = std::getenv("VALIDATE_THREADS");
+  if (threads != nullptr && std::atoi(threads) > 0) {
+    return std::atoi(threads);
+  }
+  std::size_t const hardware = std::thread::hardware_concurrency();
+  return hardware > 0 ? hardware : 1;
+}
+
+/**
+ * @brief Number of key-range partitions merged in parallel in the final
+ * external merge
+ *
+ * MERGE_THREADS, defaults to 1 (serial merge).
+ */
+inline std::size_t mergeThreads() {
+  const char *threads = std::getenv("MERGE_THREADS");
+  if (threads != nullptr && std::atoi(threads) > 0) {
+    return std::atoi(threads);
+  }
+  return 1;
+}
+
+/**
+ * @brief How the sorted runs of the first merge level are generated.
+ *
+ */
+enum class RunGen {
+  Cache,       //!< cache-sized mini runs merged into memory-sized runs
+  Replacement, //!< replacement selection over the memory work area
+  Natural,     //!< ascending and descending runs found in the input
+};
+
+inline RunGen runGen() {
+  const char *mode = std::getenv("RUN_GEN");
+  if (mode == nullptr) {
+    return RunGen::Cache;
+  }
+  if (std::string(mode) == "replacement") {
+    return RunGen::Replacement;
+  }
+  if (std::string(mode) == "natural") {
+    return RunGen::Natural;
+  }
+  return RunGen::Cache;
+}
+
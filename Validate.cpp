@@ -3,11 +3,18 @@
 #include "Device.h"
 #include "Iterator.h"
 #include "Record.h"
+#include "Utils.h"
+#include "ThreadPool.h"
+#include "Witness.h"
 #include "defs.h"
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <vector>
 
-ValidatePlan::ValidatePlan(Plan *const input)
+ValidatePlan::ValidatePlan(Plan *const input, std::string const &prefix)
     : _input(input), _outputWitnessRecord(new Record_t),
-      _inputWitnessRecord(_input->witnessRecord()),
+      _inputWitnessRecord(_input->witnessRecord()), _prefix(prefix),
       _buffer(_input->records().ptr(), 2) {
   TRACE(true);
   _outputWitnessRecord->fill(0);
@@ -21,8 +28,9 @@ Iterator *ValidatePlan::init() const {
 } // ValidatePlan::init
 
 ValidateIterator::ValidateIterator(ValidatePlan const *const plan)
-    : _count(0), _plan(plan), _input(plan->_input->init()), _out(kOut),
-      _dup_out(kDupOut) {
+    : _count(0), _plan(plan), _input(plan->_input->init()),
+      _dup_out(plan->_prefix + kDupOut), _threads(validateThreads()),
+      _sorted(true), _reported(false) {
   TRACE(true);
 } // ValidateIterator::ValidateIterator
 
@@ -33,59 +41,132 @@ ValidateIterator::~ValidateIterator() {
   traceprintf("validate %lu rows\n", (unsigned long)(_count));
 } // ValidateIterator::~ValidateIterator
 
-bool ValidateIterator::next() {
+/**
+ * @brief Pass the sorted rows through, checking their order and witness
+ *
+ */
+RowCount ValidateIterator::next_batch(RecordArr_t out, RowCount const max) {
   TRACE(true);
 
-  static bool generated = false;
-  while (_input->next()) {
-    generated = true;
+  RowCount const n = _input->next_batch(out, max);
+  if (n == 0) {
+    report();
+    return 0;
+  }
+  if (_threads > 1) {
+    _count += n;
+    return n; // the output file is checked at the end
   }
 
-  static bool val_sorted = true;
-  static uint8_t ind = 0;
-
-  if (generated) {
-    if (_count == 0) {
-      const_cast<Record_t &>(_plan->_buffer[0]).fill(Record_t::min());
-      const_cast<Record_t &>(_plan->_buffer[1]).fill(Record_t::min());
-    }
-    Record_t &buffer = const_cast<Record_t &>(_plan->_buffer[ind]);
-    while (_out.read_only(buffer, Record_t::bytes) > 0 && !buffer.isfilled()) {
-      // traceprintf("record %lu: %d %d\n", _count, buffer.key[0],
-      // buffer.key[1]);
-      ++_count;
-      _plan->_outputWitnessRecord->x_or(buffer);
-      ind ^= 1; // prev and next buffer
-      if (buffer < _plan->_buffer[ind]) {
-        // traceprintf("record not sorted %ld: prev: %d %d, cur: %d %d\n",
-        //             _count - 1, _plan->_buffer[ind].key[0],
-        //             _plan->_buffer[ind].key[1], buffer.key[0],
-        //             buffer.key[1]);
-        val_sorted = false;
-      }
-      return generated;
-    }
-    while (_dup_out.read_only(buffer, Record_t::bytes) > 0) {
-      RowCount dup_count = 0;
-      _dup_out.read_only(reinterpret_cast<char *>(&dup_count),
-                         sizeof(dup_count));
-      // traceprintf("dup record %lu: %d %d\n", dup_count, buffer.key[0],
-      //             buffer.key[1]);
-      _count += dup_count;
-      if (dup_count % 2 != 0) {
-        _plan->_outputWitnessRecord->x_or(buffer);
-      }
+  // the record passed last, _buffer[0] outlives the batches
+  Record_t &prev = const_cast<Record_t &>(_plan->_buffer[0]);
+  if (_count == 0) {
+    prev.fill(Record_t::min());
+  }
+  witness_xor(*_plan->_outputWitnessRecord, out, n);
+  for (RowCount i = 0; i < n; ++i) {
+    if (out[i] < (i == 0 ? prev : out[i - 1])) {
+      _sorted = false;
     }
+  } // for
+  prev = out[n - 1];
+  _count += n;
+  return n;
+} // ValidateIterator::next_batch
 
-    bool val_witness =
-        (*(_plan->_outputWitnessRecord.get()) == _plan->_inputWitnessRecord);
+/**
+ * @brief Add the removed duplicates to the witness and print the verdict
+ *
+ */
+void ValidateIterator::report() {
+  if (_reported) {
+    return;
+  }
+  _reported = true;
 
-    traceprintf("Witness: %s, Sorted %s\n", yesno(val_witness),
-                yesno(val_sorted));
-    generated = false;
+  if (_threads > 1) {
+    OutputCheck const check =
+        check_sorted(kDir / (_plan->_prefix + kOut), _threads);
+    _plan->_outputWitnessRecord->x_or(check.witness[0]);
+    _sorted = check.sorted && check.count == _count;
   }
 
+  Record_t &buffer = const_cast<Record_t &>(_plan->_buffer[0]);
+  while (_dup_out.read_only(buffer, Record_t::bytes) > 0) {
+    RowCount dup_count = 0;
+    _dup_out.read_only(reinterpret_cast<char *>(&dup_count),
+                       sizeof(dup_count));
+    _count += dup_count;
+    if (dup_count % 2 != 0) {
+      _plan->_outputWitnessRecord->x_or(buffer);
+    }
+  } // while
+
+  bool val_witness =
+      (*(_plan->_outputWitnessRecord.get()) == _plan->_inputWitnessRecord);
+
+  traceprintf("Witness: %s, Sorted %s\n", yesno(val_witness), yesno(_sorted));
   _plan->_outputWitnessRecord->fill(0);
+} // ValidateIterator::report
+
+OutputCheck check_sorted(std::filesystem::path const &path,
+                         std::size_t const threads) {
+  TRACE(true);
+  MappedFile const map(path);
+  auto row = [&map](RowCount const i) -> Record_t const & {
+    return *reinterpret_cast<Record_t const *>(map.data() +
+                                               i * Record_t::bytes);
+  };
+  RowCount rows = map.size() / Record_t::bytes;
+  while (rows > 0 && row(rows - 1).isfilled()) {
+    --rows; // padding of the last direct I/O chunk
+  } // while
+
+  // a few chunks per thread even out the page faults
+  std::size_t const n_chunks =
+      std::max<std::size_t>(1, std::min<RowCount>(threads * 4, rows));
+  RowCount const chunk = (rows + n_chunks - 1) / n_chunks;
+  std::vector<OutputCheck> checks(n_chunks);
+  auto check = [&](std::size_t const c) {
+    RowCount const begin = std::min(rows, c * chunk);
+    RowCount const end = std::min(rows, begin + chunk);
+    OutputCheck &result = checks[c];
+    result.witness[0].fill(0);
+    // cache-sized steps, the XOR finds the rows of the order check in cache
+    RowCount const step = std::max<RowCount>(1, kCacheSize / Record_t::bytes);
+    for (RowCount from = begin; from < end; from += step) {
+      RowCount const to = std::min(end, from + step);
+      for (RowCount i = std::max(from, begin + 1); i < to; ++i) {
+        if (row(i) < row(i - 1)) {
+          result.sorted = false;
+        }
+      } // for
+      witness_xor(result.witness[0], map.data() + from * Record_t::bytes,
+                  to - from);
+    } // for
+    result.count = end - begin;
+  };
+  {
+    ThreadPool pool(threads);
+    std::vector<std::future<void>> checking;
+    for (std::size_t c = 0; c < n_chunks; ++c) {
+      checking.push_back(pool.submit([&check, c] { check(c); }));
+    } // for
+    for (std::future<void> &done : checking) {
+      done.get();
+    } // for
+  }
 
-  return generated;
-} // ValidateIterator::next
+  OutputCheck total;
+  total.witness[0].fill(0);
+  for (std::size_t c = 0; c < n_chunks; ++c) {
+    total.count += checks[c].count;
+    total.sorted = total.sorted && checks[c].sorted;
+    total.witness[0].x_or(checks[c].witness[0]);
+    RowCount const begin = c * chunk;
+    if (c > 0 && begin < rows && row(begin) < row(begin - 1)) {
+      total.sorted = false; // the chunks are out of order
+    }
+  } // for
+  return total;
+} // check_sorted
@@ -1,12 +1,41 @@
 #include "Device.h"
 #include "Iterator.h"
 #include "Record.h"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+/**
+ * @brief Row count, order and witness of a sorted output file
+ *
+ */
+struct OutputCheck {
+  RowCount count = 0;
+  bool sorted = true;
+  RecordArr_t witness = RecordArr_t(1); //!< XOR of the rows
+};
+
+/**
+ * @brief Check the sorted output at \p path on \p threads threads
+ *
+ * The file is mapped and split into chunks checked in parallel for their
+ * internal order, XOR and row count; then the first row of every chunk is
+ * compared with the last row of the one before. Padding ends the output.
+ */
+OutputCheck check_sorted(std::filesystem::path const &path,
+                         std::size_t const threads);
 
 class ValidatePlan : public Plan {
   friend class ValidateIterator;
 
 public:
-  ValidatePlan(Plan *const input);
+  /**
+   * @brief Construct a new ValidatePlan object
+   *
+   * @param prefix of the sort output files in kDir
+   */
+  ValidatePlan(Plan *const input, std::string const &prefix = "");
   ~ValidatePlan();
   Iterator *init() const override;
 
@@ -19,6 +48,7 @@ private:
   Plan *const _input;
   std::unique_ptr<Record_t> const _outputWitnessRecord;
   Record_t const &_inputWitnessRecord;
+  std::string const _prefix;
 
   RecordArr_t const _buffer;
 }; // class ScanPlan
@@ -27,13 +57,18 @@ class ValidateIterator : public Iterator {
 public:
   ValidateIterator(ValidatePlan const *const plan);
   ~ValidateIterator();
-  bool next();
+  RowCount next_batch(RecordArr_t out, RowCount const max) override;
 
 private:
+  void report();
+
   RowCount _count;
 
   ValidatePlan const *const _plan;
   Iterator *const _input;
-  ReadDevice _out;
   ReadDevice _dup_out;
+
+  std::size_t const _threads; // check the output file in parallel if > 1
+  bool _sorted;
+  bool _reported; // the witness of the whole output is checked
 }; // class ScanIterator
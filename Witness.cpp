@@ -0,0 +1,139 @@
+#include "Witness.h"
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+void witness_xor_scalar(Record_t &witness, char const *const records,
+                        std::size_t const n) {
+  std::size_t const bytes = Record_t::bytes;
+  std::size_t const words = bytes / sizeof(uint64_t) * sizeof(uint64_t);
+  char *const acc = reinterpret_cast<char *>(witness.key);
+  for (char const *rec = records; rec != records + n * bytes; rec += bytes) {
+    std::size_t j = 0;
+    for (; j < words; j += sizeof(uint64_t)) {
+      uint64_t a, b;
+      std::memcpy(&a, acc + j, sizeof(a));
+      std::memcpy(&b, rec + j, sizeof(b));
+      a ^= b;
+      std::memcpy(acc + j, &a, sizeof(a));
+    } // for
+    for (; j < bytes; ++j) {
+      acc[j] ^= rec[j];
+    } // for
+  } // for
+} // witness_xor_scalar
+
+#if defined(__x86_64__)
+static constexpr std::size_t kAccLanes = 8; // accumulators kept in registers
+
+/**
+ * @brief XOR the bytes from \p j on of the records into \p acc, one byte
+ * column at a time
+ *
+ */
+static void witness_xor_tail(char *const acc, char const *const records,
+                             std::size_t const n, std::size_t j) {
+  std::size_t const bytes = Record_t::bytes;
+  for (; j < bytes; ++j) {
+    char sum = acc[j];
+    for (std::size_t i = 0; i < n; ++i) {
+      sum ^= records[i * bytes + j];
+    } // for
+    acc[j] = sum;
+  } // for
+} // witness_xor_tail
+
+__attribute__((target("avx2"))) static void
+witness_xor_avx2(Record_t &witness, char const *const records,
+                 std::size_t const n) {
+  std::size_t const bytes = Record_t::bytes;
+  std::size_t const lanes = bytes / 32 * 32;
+  char *const acc = reinterpret_cast<char *>(witness.key);
+  // kAccLanes lanes of the witness stay in registers across all records,
+  // then the next lanes
+  std::size_t j = 0;
+  for (; j + kAccLanes * 32 <= lanes; j += kAccLanes * 32) {
+    __m256i sum[kAccLanes];
+    for (std::size_t l = 0; l < kAccLanes; ++l) {
+      sum[l] = _mm256_loadu_si256(
+          reinterpret_cast<__m256i const *>(acc + j + 32 * l));
+    } // for
+    for (std::size_t i = 0; i < n; ++i) {
+      char const *const rec = records + i * bytes + j;
+      for (std::size_t l = 0; l < kAccLanes; ++l) {
+        __m256i const lane = _mm256_loadu_si256(
+            reinterpret_cast<__m256i const *>(rec + 32 * l));
+        sum[l] = _mm256_xor_si256(sum[l], lane);
+      } // for
+    } // for
+    for (std::size_t l = 0; l < kAccLanes; ++l) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + j + 32 * l),
+                          sum[l]);
+    } // for
+  } // for
+  for (; j < lanes; j += 32) {
+    __m256i sum =
+        _mm256_loadu_si256(reinterpret_cast<__m256i const *>(acc + j));
+    for (std::size_t i = 0; i < n; ++i) {
+      char const *const rec = records + i * bytes + j;
+      sum = _mm256_xor_si256(
+          sum, _mm256_loadu_si256(reinterpret_cast<__m256i const *>(rec)));
+    } // for
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + j), sum);
+  } // for
+  witness_xor_tail(acc, records, n, j);
+} // witness_xor_avx2
+
+__attribute__((target("avx512f"))) static void
+witness_xor_avx512(Record_t &witness, char const *const records,
+                   std::size_t const n) {
+  std::size_t const bytes = Record_t::bytes;
+  std::size_t const lanes = bytes / 64 * 64;
+  char *const acc = reinterpret_cast<char *>(witness.key);
+  // as with AVX2, in lanes of 64 bytes
+  std::size_t j = 0;
+  for (; j + kAccLanes * 64 <= lanes; j += kAccLanes * 64) {
+    __m512i sum[kAccLanes];
+    for (std::size_t l = 0; l < kAccLanes; ++l) {
+      sum[l] = _mm512_loadu_si512(acc + j + 64 * l);
+    } // for
+    for (std::size_t i = 0; i < n; ++i) {
+      char const *const rec = records + i * bytes + j;
+      for (std::size_t l = 0; l < kAccLanes; ++l) {
+        sum[l] = _mm512_xor_si512(sum[l], _mm512_loadu_si512(rec + 64 * l));
+      } // for
+    } // for
+    for (std::size_t l = 0; l < kAccLanes; ++l) {
+      _mm512_storeu_si512(acc + j + 64 * l, sum[l]);
+    } // for
+  } // for
+  for (; j < lanes; j += 64) {
+    __m512i sum = _mm512_loadu_si512(acc + j);
+    for (std::size_t i = 0; i < n; ++i) {
+      char const *const rec = records + i * bytes + j;
+      sum = _mm512_xor_si512(sum, _mm512_loadu_si512(rec));
+    } // for
+    _mm512_storeu_si512(acc + j, sum);
+  } // for
+  witness_xor_tail(acc, records, n, j);
+} // witness_xor_avx512
+#endif
+
+void witness_xor(Record_t &witness, char const *const records,
+                 std::size_t const n) {
+#if defined(__x86_64__)
+  static bool const avx512 = __builtin_cpu_supports("avx512f");
+  static bool const avx2 = __builtin_cpu_supports("avx2");
+  if (avx512 && Record_t::bytes >= 64) {
+    witness_xor_avx512(witness, records, n);
+    return;
+  }
+  if (avx2 && Record_t::bytes >= 32) {
+    witness_xor_avx2(witness, records, n);
+    return;
+  }
+#endif
+  witness_xor_scalar(witness, records, n);
+} // witness_xor
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Record.h"
+#include <cstddef>
+
+/**
+ * @brief XOR the \p n contiguous records at \p records into \p witness
+ *
+ * The records are folded in 64-byte lanes with AVX-512 or 32-byte lanes with
+ * AVX2, whichever the CPU has, else 8 bytes at a time; the result is the
+ * same either way.
+ */
+void witness_xor(Record_t &witness, char const *const records,
+                 std::size_t const n);
+void witness_xor_scalar(Record_t &witness, char const *const records,
+                        std::size_t const n);
+
+inline void witness_xor(Record_t &witness, RecordArr_t const &records,
+                        std::size_t const n) {
+  witness_xor(witness, reinterpret_cast<char const *>(records.data()), n);
+}